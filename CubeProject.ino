@@ -10,6 +10,10 @@
 \******************************************************************************/
 
 #include "cubehelper.h"
+#include "cubevm.h"
+#include "cubefont.h"
+#include "cuberandom.h"
+#include "cubepatterns.h"
 
 /* Defining int values for each primary and secondary color  */
 #define red 0
@@ -24,18 +28,86 @@
 int color = red;
 /* Initialize animation time, how many milliseconds until one animation ends and goes onto next one. */
 int animationMaxTime = 5000;
+/* How often, in milliseconds, the serial port is checked for commands. */
+#define SERIAL_POLL_TIME 20
+/* The show and the VM draw their random numbers from this seed, so a show can be replayed. */
+uint32_t cubeSeed = 2019;
+
+/* fallingRows() as a VM program, assembled from tools/examples/fallingrows.cas. */
+const byte vmFallingRows[] PROGMEM = {
+  0x05,0x00,0x00,0x03,0x01,0x04,0x03,0x10,0x40,0x01,0x07,0x04,
+  0x01,0x02,0x03,0x01,0x03,0x0D,0x0B,0x09,0x02,0x04,0x0C,0x0D,
+  0x0A,0x00,0x04,0x02,0x01,0x0E,0x03,0x12,0x00,0x0D,0x64,0x00,
+  0x01,0x02,0x0F,0x01,0x03,0x06,0x0B,0x09,0x02,0x04,0x0C,0x0D,
+  0x0A,0x00,0x04,0x02,0xFE,0x0E,0x03,0x2A,0x00,0x02,0x54,0x04,
+  0x05,0xFF,0x01,0x06,0x00,0x01,0x03,0x04,0x0B,0x09,0x02,0x04,
+  0x02,0x14,0x04,0x01,0x01,0x0E,0x01,0x54,0x00,0x0F,0x57,0x00,
+  0x09,0x06,0x05,0x0C,0x0D,0x0A,0x00,0x04,0x02,0xFF,0x04,0x06,
+  0x01,0x0E,0x03,0x44,0x00,0x04,0x04,0xFF,0x0E,0x07,0x0C,0x00,
+  0x0F,0x00,0x00
+};
 
 void setup() {
   /* Initializes the allocation the memory required for the LED cube buffers. Written by Asher Glick. */
   initCube(); 
+  /* Serial is used for uploading VM programs and for profiling output. */
+  Serial.begin(9600);
+  startTimer(SERIAL_POLL_TIME, serviceSerial, SERIAL_POLL_TIME);
+  seedPatterns(cubeSeed);
+}
+
+/*----------------------------- SERIAL COMMANDS ------------------------------*/
+/*
+ *   serviceSerial() runs from a cubetimer.h timer every SERIAL_POLL_TIME
+ * milliseconds. It only looks: when a 'U' (VM upload) or 'K' (calibration)
+ * is waiting it notes the command and ends the pattern that is playing, and
+ * loop() runs the command with runSerialCommand() before the next pattern.
+ * That way a command never runs in the middle of a pattern's flushBuffer(),
+ * and cubeasm -u still gets its first acknowledgement well inside the five
+ * seconds it waits. While a command is waiting or running the timer leaves
+ * the port alone, since the command reads the rest itself.
+ *   Any other byte, like the newline a serial monitor sends after "K", is
+ * thrown away, so it cannot sit in front of the next command.
+ */
+/*-----------------------------------------------------------------------------*/
+char serialCommand = 0;
+
+void serviceSerial() {
+  while (serialCommand == 0 && Serial.available() > 0) {
+    char command = Serial.peek();
+    if (command == 'U' || command == 'K') {
+      serialCommand = command;
+      continuePattern = false;
+    }
+    else {
+      Serial.read();
+    }
+  }
+}
+
+void runSerialCommand() {
+  if (serialCommand == 'U') vmReceiveProgram();
+  else if (serialCommand == 'K' && !calibrateLeds()) Serial.read();  // built without CUBE_LED_TRIM
+  serialCommand = 0;
+}
+
+/* Restarts the show and the VM's random stream from seed. */
+void seedPatterns(uint32_t seed) {
+  cubeSeed = seed;
+  seekShow(0);
+  seedRandom(vm_random, seed, 3);
 }
 
 void loop() {
-  /* Program will continuously loop through these four light patterns. */
-  boxFade();
-  movingDots();
-  fallingRows();
-  tunnelWarp();
+  /* Program will continuously loop through these light patterns. */
+  playShow(showLength(), cubeSeed);
+  runSerialCommand();
+  vmAnimation();
+  runSerialCommand();
+  scrollingText();
+  runSerialCommand();
+  profileRandom();
+  runSerialCommand();
 }
 
 
@@ -44,174 +116,138 @@ void loop() {
 \*---------------------------------------------------------------------------*/
 
 
-/*----------------------------------- BOX FADE ------------------------------*/
+/*------------------------------ VM ANIMATION ---------------------------------*/
 /*
- *   This animation fades through all 255 values (colors) of the LEDs, creating
- * different mixtures of each color.
- *   This pattern utilizes a drawBox function, which essentially lights up the whole
- * cube (all 64 LEDs) and syncs them together so that they all emit the same color.
- *   The first for loop slowly lights up the cube, while the second for loop slowly allows
- * the LEDs to fade out. The process repeats.
+ *   This animation runs the program that was last uploaded over serial, or the
+ * built in VM version of fallingRows when nothing has been uploaded yet.
+ *   Building with CUBE_PROFILE prints the cost of each VM frame, which can be
+ * compared against the native patterns above.
  */
-/*---------------------------------------------------------------------------*/
-void boxFade() {
-  continuePattern = true;
-  int animationSpeed = 30;
-  unsigned long startTime = millis();
-  while (continuePattern) {
-    int color = random(0,6);
-    for (int i = 1; i <= 15; i++)  {
-      drawBox(color,i,0,0,0,3,3,3);
-      flushBuffer();
-      clearBuffer();
-      delay(animationSpeed);
-    }
-    delay(animationSpeed*20);   
-    for (int i = 1; i <= 15; i++) {
-      drawBox(color,15-i,0,0,0,3,3,3);
-      flushBuffer();
-      clearBuffer();
-      delay(animationSpeed);
-    }
-    Serial.println(startTime);
-    if (millis()-startTime > animationMaxTime){
-      break;
-    }
+/*-----------------------------------------------------------------------------*/
+void vmAnimation() {
+  if (!vmLoadEeprom()) {
+    vmLoadProgmem(vmFallingRows, sizeof(vmFallingRows));
   }
+  runVm(animationMaxTime);
+  printFrameProfile("vmAnimation");
 }
 
-
-/*--------------------------------- MOVING DOTS -----------------------------*/
+/*------------------------------ SCROLLING TEXT -------------------------------*/
 /*
- *   This animation creates random points of light that move around the cube in
- * random fashion and constantly changes color.
- *   This pattern utilizes the drawLed function, which lights up a single LED at
- * the specified position. 
- *   Similar to the boxFade, the movingDots uses a fade-in, fade-out technique to
- * create transitions.
+ *   This animation scrolls a message across the front face of the cube, flies
+ * a heart from the back of the cube to the front, then spins it around the
+ * four side faces.
+ *   Text and sprites are drawn with the blitter in cubefont.h, which writes
+ * whole glyph rows into the buffer instead of calling drawLed for every LED.
+ * Each frame is cleared before it is drawn, so with CUBE_PROFILE the frame
+ * cost is the blit and the flush, not the delay between frames.
  */
-/*--------------------------------- ---------- -----------------------------*/
-void movingDots() {
-  continuePattern = true;
-  int animationSpeed = 20;
-  unsigned long startTime = millis();
-  while (continuePattern) {
-    int pos = random(0,3);
-    int color = random(0,6);
-    for (int i = 1; i <= 15; i++)  {
-      drawLed(color, i, pos, pos, pos);
-      flushBuffer();
-      clearBuffer();
-      delay(animationSpeed);
-    }
-    delay(animationSpeed*10);   
-    for (int i = 1; i <= 15; i++) {
-      drawLed(color, 15-i, pos, pos, pos);
-      flushBuffer();
-      clearBuffer();
-      delay(animationSpeed);
-    }
-    if (millis()-startTime > animationMaxTime){
-      break;
-    }
+/*-----------------------------------------------------------------------------*/
+void scrollingText() {
+  startPatternTimer(animationMaxTime*2);
+  int animationSpeed = 80;
+  const char * message = "HELLO CUBE";
+  int length = strlen(message);
+
+  for (int scroll = 0; scroll <= 4*(length+1) && continuePattern; scroll++) {
+    clearBuffer();
+    blitText(_cube_buffer, message, scroll, (scroll/4)%6, 15, FACE_FRONT, 0);
+    flushBuffer();
+    delay(animationSpeed);
+  }
+
+  for (int depth = 3; depth >= 0 && continuePattern; depth--) {
+    clearBuffer();
+    blitGlyph(_cube_buffer, SPRITE_HEART, red, 15, FACE_FRONT, depth);
+    flushBuffer();
+    delay(animationSpeed*2);
   }
-  
-}
 
+  /* front, right, back and left faces, mirrored where they are seen from behind */
+  for (int turn = 0; turn < 8 && continuePattern; turn++) {
+    uint16_t heart = SPRITE_HEART;
+    byte face = (turn % 2 == 0) ? FACE_FRONT : FACE_SIDE;
+    byte depth = ((turn % 4) < 2) ? 0 : 3;
+    if ((turn % 4) == 1 || (turn % 4) == 2) heart = mirrorGlyph(heart);
+    clearBuffer();
+    blitGlyph(_cube_buffer, heart, purple, 15, face, depth);
+    flushBuffer();
+    delay(animationSpeed*3);
+  }
+  printFrameProfile("scrollingText");
+  profileGlyphBlit();
+}
 
-/*------------------------------- FALLING ROWS --------------------------------*/
+/*---------------------------- PROFILE GLYPH BLIT -----------------------------*/
 /*
- *   This animation lights up each layer in descending order, similar to falling. 
- * Each iteration will change the color of the lights that light up.
- *   This pattern is achieved by creating helper functions called drawRow and diffusedRow.
- * drawRow simply lights up a whole layer of the cube, while diffusedRow fades in each row,
- * then fades out, creating a more fluid transition.
+ *   Times drawing the alphabet with blitGlyph against drawing the same pixels
+ * one at a time with drawLed. Only built with CUBE_PROFILE.
  */
-/*--------------------------------- ---------- --------------------------------*/
-void fallingRows(){
-  continuePattern = true;
-  int animationSpeed = 10;
-  int brightness = 9;
-  unsigned long startTime = millis();
+/*-----------------------------------------------------------------------------*/
+#ifdef CUBE_PROFILE
+void profileGlyphBlit() {
+  unsigned long startTime = micros();
+  for (char c = 'A'; c <= 'Z'; c++) {
+    blitGlyph(_cube_buffer, getGlyph(c), teal, 8, FACE_FRONT, 0);
+  }
+  unsigned long blitTime = micros() - startTime;
 
-  while (continuePattern){
-    int color = random(0,3);
-    int sequenceR[] = {0,1,2,3};
-    int sequenceG[] = {1,2,3,0};
-    int sequenceB[] = {2,3,0,1};
-
-    if (color == red){
-      for(int k = 0; k <= 3; k+=1){
-          diffusedRow(color, sequenceR[k], animationSpeed);
-        }
-      }
-    else if (color == green){
-      for(int k = 0; k <= 3; k+=1){
-          diffusedRow(color, sequenceG[k], animationSpeed);
-        }
-      }
-    else if (color == blue){
-      for(int k = 0; k <= 3; k+=1){
-          diffusedRow(color, sequenceB[k], animationSpeed);
+  startTime = micros();
+  for (char c = 'A'; c <= 'Z'; c++) {
+    uint16_t glyph = getGlyph(c);
+    for (int row = 0; row <= 3; row++) {
+      for (int col = 0; col <= 3; col++) {
+        if (glyph & (0x8000 >> (row*4 + col))) drawLed(teal, 8, 0, col, 3-row);
       }
     }
-    if (millis()-startTime > animationMaxTime){
-      break;
-    }
   }
+  unsigned long drawTime = micros() - startTime;
+  clearBuffer();
+
+  Serial.print(F("blitGlyph: "));
+  Serial.print(blitTime / 26);
+  Serial.print(F("us per glyph, drawLed loop: "));
+  Serial.print(drawTime / 26);
+  Serial.println(F("us per glyph"));
 }
+#else
+void profileGlyphBlit() {}
+#endif
 
-/*------------------------------- TUNNEL WARP ---------------------------------*/
+/*------------------------------ PROFILE RANDOM -------------------------------*/
 /*
- *   This animation lights up the whole cube like the boxFade, but it changes the
- * color of specific LEDs in the cube to create a dynamic feeling, as if the lights
- * are travelling through a tunnel and constantly changing.
- *   This animation is achieved by calling repeatedly a helper function called 
- *   drawBoxWalls, which draws the vertical walls and all four sides of a defined box.
+ *   Times the Arduino random() against the pattern streams in a loop like
+ * movingDots, drawing a dot with a random color and position 256 times.
+ * Only built with CUBE_PROFILE.
  */
 /*-----------------------------------------------------------------------------*/
-void tunnelWarp() {
-  continuePattern = true;
-  int animationSpeed = 100;
-  unsigned long startTime = millis();
-  
-  int color1[]  = {red,red,red,red,blue,blue,blue,blue};
-  int bright1[] = {2,4,6,8,2,4,6,8};
-  int color2[]  = {blue,blue,blue,blue,red,red,red,red};
-  int bright2[] = {8,6,4,2,8,6,4,2};
-  
-  int index[]   = {0,1,2,3,4,5,6,7};
-  
-  while (continuePattern) {
-    drawBoxWalls(color1[index[0]],bright1[index[0]],1,1,0,2,2,0);
-    drawBoxWalls(color2[index[0]],bright2[index[0]],1,1,0,2,2,0);
-    drawBoxWalls(color1[index[1]],bright1[index[1]],1,1,1,2,2,1);
-    drawBoxWalls(color2[index[1]],bright2[index[1]],1,1,1,2,2,1);
-    drawBoxWalls(color1[index[2]],bright1[index[2]],1,1,2,2,2,2);
-    drawBoxWalls(color2[index[2]],bright2[index[2]],1,1,2,2,2,2);
-    drawBoxWalls(color1[index[3]],bright1[index[3]],1,1,3,2,2,3);
-    drawBoxWalls(color2[index[3]],bright2[index[3]],1,1,3,2,2,3);
-    
-    drawBoxWalls(color1[index[4]],bright1[index[4]],0,0,3,3,3,3);
-    drawBoxWalls(color2[index[4]],bright2[index[4]],0,0,3,3,3,3);
-    drawBoxWalls(color1[index[5]],bright1[index[5]],0,0,2,3,3,2);
-    drawBoxWalls(color2[index[5]],bright2[index[5]],0,0,2,3,3,2);
-    drawBoxWalls(color1[index[6]],bright1[index[6]],0,0,1,3,3,1);
-    drawBoxWalls(color2[index[6]],bright2[index[6]],0,0,1,3,3,1);
-    drawBoxWalls(color1[index[7]],bright1[index[7]],0,0,0,3,3,0);
-    drawBoxWalls(color2[index[7]],bright2[index[7]],0,0,0,3,3,0);
-    
-    flushBuffer();
-    clearBuffer();
-    for (int i = 0; i < 8; i++){
-      index[i] = (index[i]+1)%8;
-    }
-    delay(animationSpeed); 
-    if (millis()-startTime > animationMaxTime){
-      break;
-    }
+#ifdef CUBE_PROFILE
+void profileRandom() {
+  CubeRandom stream;
+  seedRandom(stream, cubeSeed, 0);
+
+  unsigned long startTime = micros();
+  for (int i = 0; i < 256; i++) {
+    drawLed(random(0,6), 8, random(0,4), random(0,4), random(0,4));
+  }
+  unsigned long arduinoTime = micros() - startTime;
+
+  startTime = micros();
+  for (int i = 0; i < 256; i++) {
+    drawLed(randomRange(stream,0,6), 8, randomRange(stream,0,4), randomRange(stream,0,4), randomRange(stream,0,4));
   }
+  unsigned long streamTime = micros() - startTime;
+  clearBuffer();
+
+  Serial.print(F("random(): "));
+  Serial.print(arduinoTime / 256);
+  Serial.print(F("us per dot, randomRange(): "));
+  Serial.print(streamTime / 256);
+  Serial.println(F("us per dot"));
 }
+#else
+void profileRandom() {}
+#endif
 
 /*---------------------------------------------------------------------------*\
 |*----------------------------- SPECIFIC ACTIONS ----------------------------*|
@@ -220,32 +256,40 @@ void tunnelWarp() {
 /*--------------------------------- DRAW LED -------------------------------*/
 /*
  * This method turns on LEDs at a specific position of int x, y, and z.
- * The color ranges from 0 to 255, while the brightness ranges from 0 to 255.
+ * The color ranges from 0 to 255, while the brightness ranges from 0 to
+ * GAMMA_MAX (15). Levels add up when LEDs are drawn twice, and anything
+ * above GAMMA_MAX is shown as full brightness.
  */
 /*--------------------------------------------------------------------------*/
 void drawLed(int color, int brightness, int x, int y, int z) {
+  int led = (x*16)+(y*4)+z;
   
   if ((color/3)==0) { // single color (red green blue)
-    _cube_buffer[(((color)%3)*64)+(x*16)+(y*4)+z] += brightness;
-    _cube_buffer[(((color+1)%3)*64)+(x*16)+(y*4)+z] += 0;
+    _cube_buffer[(((color)%3)*64)+led] += brightness;
+    markLit(_cube_buffer, (((color)%3)*64)+led);
   }
   else if ((color/3)==1) { // double color (teal yellow purple)
-    _cube_buffer[(((color)%3)*64)+(x*16)+(y*4)+z] += brightness;
-    _cube_buffer[(((color+1)%3)*64)+(x*16)+(y*4)+z] += brightness;
+    _cube_buffer[(((color)%3)*64)+led] += brightness;
+    _cube_buffer[(((color+1)%3)*64)+led] += brightness;
+    markLit(_cube_buffer, (((color)%3)*64)+led);
+    markLit(_cube_buffer, (((color+1)%3)*64)+led);
   }
   else if (color == 6){ // all colors (white)
-    _cube_buffer[((0)*64)+(x*16)+(y*4)+z] += brightness;
-    _cube_buffer[((1)*64)+(x*16)+(y*4)+z] += brightness;
-    _cube_buffer[((2)*64)+(x*16)+(y*4)+z] += brightness;
+    _cube_buffer[((0)*64)+led] += brightness;
+    _cube_buffer[((1)*64)+led] += brightness;
+    _cube_buffer[((2)*64)+led] += brightness;
+    markLit(_cube_buffer, ((0)*64)+led);
+    markLit(_cube_buffer, ((1)*64)+led);
+    markLit(_cube_buffer, ((2)*64)+led);
   }
   else if (color == -7) {
-    _cube_buffer[((0)*64)+(x*16)+(y*4)+z] = 0;
-    _cube_buffer[((1)*64)+(x*16)+(y*4)+z] = 0;
-    _cube_buffer[((2)*64)+(x*16)+(y*4)+z] = 0;
+    _cube_buffer[((0)*64)+led] = 0;
+    _cube_buffer[((1)*64)+led] = 0;
+    _cube_buffer[((2)*64)+led] = 0;
   }
 }
 void drawLed(int color, int x, int y, int z) {
-  drawLed(color,255,x,y,z);
+  drawLed(color,GAMMA_MAX,x,y,z);
 }
 
 /*--------------------------------- DRAW BOX -------------------------------*/
@@ -268,7 +312,7 @@ void drawBox(int color, int brightness, int startx, int starty, int startz, int
   }
 }
 void drawBox(int color, int startx, int starty, int startz, int endx, int endy, int endz) {
-  drawBox(color,8,startx,starty,startz,endx,endy,endz);
+  drawBox(color,GAMMA_MAX,startx,starty,startz,endx,endy,endz);
 }
 
 /*--------------------------------- DRAW ROW -------------------------------*/
@@ -285,31 +329,7 @@ void drawRow(int color, int brightness, int z){
 }
 
 void drawRow(int color, int z){
-  drawRow(color, 8, z);
-}
-
-/*---------------------------- DRAW DIFFUSED ROW ---------------------------*/
-/*
- * This method utilizes the drawRow method to create a more fluid transition.
- */
-/*--------------------------------------------------------------------------*/
-void diffusedRow(int color, int level, int animationSpeed){
-  for (int i = 3; i <= 15; i++)  {
-    drawRow(color, i, 3-level);
-    flushBuffer();
-    clearBuffer();
-    delay(animationSpeed);
-  }
-  delay(animationSpeed*10);   
-  for (int i = 0; i <= 9; i++) {
-    drawRow(color, 9-i, 3-level);
-    if (i >= 6){
-      drawRow(color, i-6, 2-level);
-    }
-    flushBuffer();
-    clearBuffer();
-    delay(animationSpeed);
-  }
+  drawRow(color, GAMMA_MAX, z);
 }
 
 /*----------------------------- DRAW BOX WALLS -----------------------------*/
@@ -337,7 +357,7 @@ void drawBoxWalls(int color, int brightness, int startx, int starty,
   }
 }
 void drawBoxWalls(int color, int startx, int starty, int startz, int endx, int endy, int endz) {
-  drawBoxWalls(color,255,startx,starty,startz,endx,endy,endz);
+  drawBoxWalls(color,GAMMA_MAX,startx,starty,startz,endx,endy,endz);
 }
 
 /*------------------------------- LED CHECKER ------------------------------*/
@@ -349,7 +369,7 @@ void LEDCheck(){
   continuePattern = true;
   int animationSpeed = 200;
   int color = red;
-  int brightness = 9;
+  int brightness = GAMMA_MAX;
   while (continuePattern){
     for(int k = 0; k <= 3; k+=1){
       for(int i = 0; i <= 3; i+=1){
@@ -363,3 +383,70 @@ void LEDCheck(){
     }
   }
 }
+
+/*----------------------------- LED CALIBRATION ----------------------------*/
+/*
+ * This method sets the per LED trims in cubegamma.h, like LEDColumnTest.ino
+ * does one column at a time. Sending 'K' over serial starts it. It lights
+ * each LED color next to the first LED of the same color, which is the
+ * reference, and the trim is changed until both look the same:
+ *   + dimmer   - brighter   n next   p previous   s save   q quit
+ * Quitting without saving goes back to the trims stored in EEPROM. Only
+ * built with CUBE_LED_TRIM.
+ */
+/*--------------------------------------------------------------------------*/
+#ifdef CUBE_LED_TRIM
+bool calibrateLeds() {
+  if (Serial.available() == 0 || Serial.peek() != 'K') {
+    return false;
+  }
+  Serial.read();
+  Serial.println(F("calibrate: + dimmer, - brighter, n next, p previous, s save, q quit"));
+
+  byte index = 1;
+  bool showing = true;
+  while (true) {
+    byte plane = index / 64;
+    byte reference = plane * 64;
+    clearBuffer();
+    _cube_buffer[reference] = GAMMA_MAX;
+    _cube_buffer[index] = GAMMA_MAX;
+    markLit(_cube_buffer, reference);
+    markLit(_cube_buffer, index);
+    flushBuffer();
+
+    if (showing) {
+      Serial.print(F("led "));
+      Serial.print((index % 64) / 16);
+      Serial.print(F(","));
+      Serial.print((index % 16) / 4);
+      Serial.print(F(","));
+      Serial.print(index % 4);
+      Serial.print(plane == 0 ? F(" red") : (plane == 1 ? F(" green") : F(" blue")));
+      Serial.print(F(" trim "));
+      Serial.println(getLedTrim(index));
+      showing = false;
+    }
+
+    while (Serial.available() == 0) {
+      yield();
+    }
+    char command = Serial.read();
+    byte trim = getLedTrim(index);
+    if (command == '+' && trim < GAMMA_TRIMS-1) setLedTrim(index, trim+1);
+    else if (command == '-' && trim > 0) setLedTrim(index, trim-1);
+    else if (command == 'n') index = (index+1) % BUFFERSIZE;
+    else if (command == 'p') index = (index+BUFFERSIZE-1) % BUFFERSIZE;
+    else if (command == 's') { saveLedTrim(); Serial.println(F("calibrate: saved")); }
+    else if (command == 'q') break;
+    showing = true;
+  }
+
+  loadLedTrim();
+  clearBuffer();
+  flushBuffer();
+  return true;
+}
+#else
+bool calibrateLeds() { return false; }
+#endif
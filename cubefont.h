@@ -0,0 +1,170 @@
+/******************************************************************************\
+| CUBEFONT.H                                                                   |
+|                                                                              |
+| A 4x4 font and sprite blitter for drawing text on the faces of the cube.     |
+| Each glyph is packed into 16 bits in PROGMEM, one nibble per row, and is     |
+| copied into the color planes of a buffer with shifts and masks instead of    |
+| one drawLed() call per LED.                                                  |
+\******************************************************************************/
+
+#ifndef _CUBEFONT_H_
+#define _CUBEFONT_H_
+
+#ifdef ARDUINO
+#include "cubehelper.h"
+#include <avr/pgmspace.h>
+#endif
+
+/*------------------------------------ FONT ---------------------------------*/
+/*
+ *   One glyph for every character from ' ' to 'Z'. The top row is the high
+ *   nibble and the leftmost column of a row is its highest bit, so 'A' is
+ *
+ *     .XX.  0110
+ *     X..X  1001   = 0x69F9
+ *     XXXX  1111
+ *     X..X  1001
+ *
+ *   Characters without a glyph are blank. Lower case is drawn as upper case.
+ */
+/*---------------------------------------------------------------------------*/
+#define FONT_FIRST ' '
+#define FONT_LAST  'Z'
+
+const uint16_t cube_font[] PROGMEM = {
+  0x0000,0x4404,0xAA00,0xAFFA,0x7E7E,0x9249,0x4A5B,0x4400, //  !"#$%&'
+  0x2442,0x4224,0xA4A0,0x04E4,0x0048,0x00E0,0x0004,0x1248, // ()*+,-./
+  0x6996,0x4C4E,0xE34F,0xE61E,0xAAF2,0xFE1E,0x78FF,0xF124, // 01234567
+  0xF69F,0xFF1E,0x0404,0x0408,0x2422,0x0F0F,0x4244,0xE304, // 89:;<=>?
+  0x6BA6,0x69F9,0xEE9E,0x7887,0xE99E,0xFE8F,0xFE88,0x78B7, // @ABCDEFG
+  0x9F99,0xE44E,0x1196,0x9EA9,0x888F,0x9FF9,0x9DB9,0x6996, // HIJKLMNO
+  0xE9E8,0x69B7,0xE9E9,0x7C3E,0xE444,0x9996,0x99A4,0x99F6, // PQRSTUVW
+  0x9669,0xAA44,0xF24F                                     // XYZ
+};
+
+/* A few sprites in the same format as the font. */
+#define SPRITE_HEART  0xAFE4
+#define SPRITE_ARROW  0x4EF4
+#define SPRITE_SQUARE 0xF99F
+#define SPRITE_DIAMOND 0x4AA4
+
+/* The faces a glyph can be drawn on. depth picks which slice of the cube. */
+#define FACE_FRONT 0  // columns run along y, rows run down z, depth is x
+#define FACE_SIDE  1  // columns run along x, rows run down z, depth is y
+#define FACE_TOP   2  // columns run along x, rows run along y, depth is z
+
+/*---------------------------------- GET GLYPH ------------------------------*/
+/*
+ *   Returns the packed glyph for a character.
+ */
+/*---------------------------------------------------------------------------*/
+uint16_t getGlyph(char c) {
+  if (c >= 'a' && c <= 'z') c -= 'a' - 'A';
+  if (c < FONT_FIRST || c > FONT_LAST) return 0;
+  return pgm_read_word(&cube_font[c - FONT_FIRST]);
+}
+
+/*-------------------------------- ROTATE GLYPH -----------------------------*/
+/*
+ *   Turns a glyph a quarter turn clockwise. Rotating is done once per frame
+ *   on the packed glyph, so the blit itself never has to care about it.
+ */
+/*---------------------------------------------------------------------------*/
+uint16_t rotateGlyph(uint16_t glyph, byte quarterTurns) {
+  quarterTurns &= 3;
+  while (quarterTurns--) {
+    uint16_t turned = 0;
+    for (byte row = 0; row < 4; row++) {
+      for (byte col = 0; col < 4; col++) {
+        if (glyph & (0x8000 >> (row*4 + col))) {
+          turned |= 0x8000 >> (col*4 + (3-row));
+        }
+      }
+    }
+    glyph = turned;
+  }
+  return glyph;
+}
+
+/*-------------------------------- MIRROR GLYPH -----------------------------*/
+/*
+ *   Flips a glyph left to right, for faces that are seen from behind.
+ */
+/*---------------------------------------------------------------------------*/
+uint16_t mirrorGlyph(uint16_t glyph) {
+  uint16_t mirrored = 0;
+  for (byte col = 0; col < 4; col++) {
+    mirrored |= ((glyph >> col) & 0x1111) << (3-col);
+  }
+  return mirrored;
+}
+
+/*-------------------------------- SCROLL GLYPHS ----------------------------*/
+/*
+ *   Returns the 4x4 window that is shift columns (0 to 4) into the pair of
+ *   glyphs left and right, which is what scrolling text shows between two
+ *   characters.
+ */
+/*---------------------------------------------------------------------------*/
+uint16_t scrollGlyphs(uint16_t left, uint16_t right, byte shift) {
+  uint16_t window = 0;
+  for (byte row = 0; row < 4; row++) {
+    byte pair = ((left >> 8) & 0xF0) | (right >> 12);
+    window = (window << 4) | (((pair << shift) >> 4) & 0x0F);
+    left <<= 4;
+    right <<= 4;
+  }
+  return window;
+}
+
+/*---------------------------------- BLIT GLYPH -----------------------------*/
+/*
+ *   Copies a packed glyph into the color planes of buffer on the given face
+ *   and slice. Lit pixels overwrite whatever was there and unlit pixels are
+ *   left alone, so glyphs can be layered on top of a background.
+ */
+/*---------------------------------------------------------------------------*/
+void blitGlyph(char * buffer, uint16_t glyph, int color, byte brightness, byte face, byte depth) {
+  char start, colStep, rowStep;
+  depth &= 3;
+  if (face == FACE_FRONT)     { start = depth*16 + 3; colStep = 4;  rowStep = -1; }
+  else if (face == FACE_SIDE) { start = depth*4 + 3;  colStep = 16; rowStep = -1; }
+  else                        { start = depth;        colStep = 16; rowStep = 4;  }
+
+  if (color < 0 || color > 6) return;
+  byte planes = _color_planes[color];
+
+  for (byte plane = 0; plane < 3; plane++, planes >>= 1) {
+    if ((planes & 1) == 0) continue;
+    char * rowStart = buffer + plane*64 + start;
+    uint16_t bits = glyph;
+    for (byte row = 0; row < 4; row++, rowStart += rowStep) {
+      byte nibble = bits >> 12;
+      bits <<= 4;
+      char * led = rowStart;
+      while (nibble) {
+        if (nibble & 0x08) { *led = brightness; markLit(buffer, led - buffer); }
+        nibble = (nibble << 1) & 0x0F;
+        led += colStep;
+      }
+    }
+  }
+}
+
+/*---------------------------------- BLIT TEXT ------------------------------*/
+/*
+ *   Draws the part of text that is visible scroll columns into the string.
+ *   Each character is four columns wide, so text scrolls one LED column per
+ *   step of scroll and the string is finished at scroll = 4*(length+1).
+ */
+/*---------------------------------------------------------------------------*/
+void blitText(char * buffer, const char * text, int scroll, int color, byte brightness, byte face, byte depth) {
+  int index = scroll / 4 - 1;
+  byte shift = scroll % 4;
+  int length = strlen(text);
+  uint16_t left = (index >= 0 && index < length) ? getGlyph(text[index]) : 0;
+  uint16_t right = (index+1 >= 0 && index+1 < length) ? getGlyph(text[index+1]) : 0;
+  blitGlyph(buffer, scrollGlyphs(left, right, shift), color, brightness, face, depth);
+}
+
+#endif
@@ -0,0 +1,141 @@
+/******************************************************************************\
+| CUBEGAMMA.H                                                                  |
+|                                                                              |
+| Gamma and white balance correction for the three color planes. Patterns     |
+| draw brightness 0 to 15 on a linear scale, and flushBuffer() turns that      |
+| into the PWM level the display shows with one PROGMEM lookup per lit LED     |
+| color, so nothing is added to the display interrupt. The tables are built    |
+| by the preprocessor from CUBE_GAMMA_* below, and each LED color can also be  |
+| dimmed by a trim stored in EEPROM, set with calibrateLeds().                 |
+\******************************************************************************/
+
+#ifndef _CUBEGAMMA_H_
+#define _CUBEGAMMA_H_
+
+#ifdef ARDUINO
+#include "Arduino.h"
+#include <avr/pgmspace.h>
+#include <avr/eeprom.h>
+#endif
+
+#ifndef PWMMMAX
+  #define PWMMMAX 8
+#endif
+
+/*------------------------------- WHITE BALANCE -----------------------------*/
+/*
+ *   How bright each plane is allowed to get, from 0 to 255, so the planes
+ *   can be matched to each other. Full scale on every plane until the cube
+ *   has been measured; define these before including cubehelper.h to
+ *   override them.
+ */
+/*---------------------------------------------------------------------------*/
+#ifndef CUBE_GAMMA_RED
+  #define CUBE_GAMMA_RED   255
+#endif
+#ifndef CUBE_GAMMA_GREEN
+  #define CUBE_GAMMA_GREEN 255
+#endif
+#ifndef CUBE_GAMMA_BLUE
+  #define CUBE_GAMMA_BLUE  255
+#endif
+
+/*-------------------------------- GAMMA TABLES -----------------------------*/
+/*
+ *   PWM level = PWMMMAX * scale/255 * (level/15)^2, rounded, and never 0
+ *   for a lit LED so a dim pixel does not disappear. A square is as close to
+ *   the usual 2.2 as 8 PWM levels can show. Buffer values above 15 are
+ *   treated as 15.
+ *
+ *   There are GAMMA_TRIMS copies of the table for each plane: trim 0 is the
+ *   plain table and each trim after it is 20% dimmer. With CUBE_LED_TRIM
+ *   defined, each LED color picks its copy from _led_trim[].
+ */
+/*---------------------------------------------------------------------------*/
+#define GAMMA_MAX 15
+
+#define _GAMMA_ROUND(level, scale) \
+  ((PWMMMAX * (long)(scale) * (level) * (level) + 255L*GAMMA_MAX*GAMMA_MAX/2) / (255L*GAMMA_MAX*GAMMA_MAX))
+#define _GAMMA(level, scale) \
+  ((level) == 0 || (scale) == 0 ? 0 : (_GAMMA_ROUND(level, scale) ? _GAMMA_ROUND(level, scale) : 1))
+#define _GAMMA_ROW(scale) { \
+  _GAMMA( 0,scale),_GAMMA( 1,scale),_GAMMA( 2,scale),_GAMMA( 3,scale), \
+  _GAMMA( 4,scale),_GAMMA( 5,scale),_GAMMA( 6,scale),_GAMMA( 7,scale), \
+  _GAMMA( 8,scale),_GAMMA( 9,scale),_GAMMA(10,scale),_GAMMA(11,scale), \
+  _GAMMA(12,scale),_GAMMA(13,scale),_GAMMA(14,scale),_GAMMA(15,scale)}
+#define _GAMMA_TRIM(trim) { \
+  _GAMMA_ROW(CUBE_GAMMA_RED   * (5-(trim)) / 5), \
+  _GAMMA_ROW(CUBE_GAMMA_GREEN * (5-(trim)) / 5), \
+  _GAMMA_ROW(CUBE_GAMMA_BLUE  * (5-(trim)) / 5)}
+
+#ifdef CUBE_LED_TRIM
+  #define GAMMA_TRIMS 4
+  const byte cube_gamma[GAMMA_TRIMS][3][GAMMA_MAX+1] PROGMEM = {
+    _GAMMA_TRIM(0), _GAMMA_TRIM(1), _GAMMA_TRIM(2), _GAMMA_TRIM(3)
+  };
+#else
+  #define GAMMA_TRIMS 1
+  const byte cube_gamma[GAMMA_TRIMS][3][GAMMA_MAX+1] PROGMEM = {
+    _GAMMA_TRIM(0)
+  };
+#endif
+
+/*---------------------------------- LED TRIM -------------------------------*/
+/*
+ *   Two bits of trim for each of the 192 LED colors, in _cube_buffer order,
+ *   four to a byte. They are kept in RAM while the cube runs and stored in
+ *   EEPROM after the VM program area behind a two byte 'C' 'G' header. A
+ *   cube that has never been calibrated gets trim 0 everywhere.
+ */
+/*---------------------------------------------------------------------------*/
+#define TRIM_EEPROM_BASE 768
+#define TRIM_EEPROM_HEADER 2
+#define TRIM_BYTES (192/4)
+
+#ifdef CUBE_LED_TRIM
+byte _led_trim[TRIM_BYTES];
+
+byte getLedTrim(byte index) {
+  return (_led_trim[index >> 2] >> ((index & 3) * 2)) & 3;
+}
+
+void setLedTrim(byte index, byte trim) {
+  byte shift = (index & 3) * 2;
+  _led_trim[index >> 2] = (_led_trim[index >> 2] & ~(3 << shift)) | ((trim & 3) << shift);
+}
+
+void loadLedTrim() {
+  const byte * header = (const byte *)TRIM_EEPROM_BASE;
+  bool valid = eeprom_read_byte(header) == 'C' && eeprom_read_byte(header+1) == 'G';
+  for (byte i = 0; i < TRIM_BYTES; i++) {
+    _led_trim[i] = valid ? eeprom_read_byte(header + TRIM_EEPROM_HEADER + i) : 0;
+  }
+}
+
+void saveLedTrim() {
+  byte * header = (byte *)TRIM_EEPROM_BASE;
+  for (byte i = 0; i < TRIM_BYTES; i++) {
+    eeprom_update_byte(header + TRIM_EEPROM_HEADER + i, _led_trim[i]);
+  }
+  eeprom_update_byte(header, 'C');
+  eeprom_update_byte(header+1, 'G');
+}
+#else
+inline byte getLedTrim(byte /*index*/) { return 0; }
+inline void setLedTrim(byte /*index*/, byte /*trim*/) {}
+inline void loadLedTrim() {}
+inline void saveLedTrim() {}
+#endif
+
+/*------------------------------- CORRECT LEVEL -----------------------------*/
+/*
+ *   The PWM level for buffer value level of LED color index. flushBuffer()
+ *   does the same lookup inline.
+ */
+/*---------------------------------------------------------------------------*/
+byte correctLevel(byte index, byte level) {
+  if (level > GAMMA_MAX) level = GAMMA_MAX;
+  return pgm_read_byte(&cube_gamma[getLedTrim(index)][index / 64][level]);
+}
+
+#endif
@@ -15,54 +15,381 @@
 #include "Arduino.h"
 #include "cubemappings.h"
 #include "niceTimer.h"
+#include "cubetimer.h"
+#include "cubegamma.h"
+#include "cubemask.h"
+#include "cubelog.h"
+#include <avr/sleep.h>
 
-/* _frame_light is used in flushing the initialized LEDs and resetting for the next animation. */
-struct _frame_light{
-  char pin1;
-  char pin2;
-  struct _frame_light * next;
+/*-------------------------------- FRAME QUEUE ------------------------------*/
+/*
+ *   Frames that have been flushed wait here until their presentation time,
+ *   so the main loop can render several frames ahead and a slow frame does
+ *   not show up as a stutter. Each frame is a run of _display_entry in the
+ *   _frame_entries ring, one entry for every lit LED color. Frames take up
+ *   as many entries as they have lit LEDs, so the default FRAME_ENTRIES
+ *   holds two full cubes or many sparse frames, and FRAME_QUEUE_SLOTS limits
+ *   how many frames can be waiting at once. FRAME_ENTRIES must be at least
+ *   2*BUFFERSIZE, or a full frame could wait forever behind another one.
+ *
+ *   The main loop is the only writer of _queue_head and the display
+ *   interrupt the only writer of _queue_tail. Slot _queue_tail is on
+ *   display, the slots after it up to _queue_head are waiting.
+ */
+/*---------------------------------------------------------------------------*/
+#ifndef FRAME_ENTRIES
+  #define FRAME_ENTRIES 384
+#endif
+#ifndef FRAME_QUEUE_SLOTS
+  #define FRAME_QUEUE_SLOTS 4   // must be a power of two
+#endif
+#define FRAME_QUEUE_MASK (FRAME_QUEUE_SLOTS-1)
+#if FRAME_ENTRIES < 2*BUFFERSIZE
+  #error FRAME_ENTRIES must hold at least two full frames
+#endif
+
+struct _display_entry {
+  byte pins;        // cube_pins[] value for this LED color
+  byte brightness;
+};
+
+struct _queued_frame {
+  _display_entry * start;
+  _display_entry * end;
+  unsigned long pts;   // timerMillis() when this frame should be shown
+  byte lit;            // lit LED colors, 0 for a blank frame
 };
 
-/* these commands are used for clearing animations. */
-_frame_light * _cube__frame;
-_frame_light * _cube_current_frame;
+_display_entry * _frame_entries;
+_display_entry * _pool_end;
+_queued_frame _frame_queue[FRAME_QUEUE_SLOTS];
+volatile byte _queue_head = 1;
+volatile byte _queue_tail = 0;
+
+/* where the display interrupt is in the frame it is showing */
+_display_entry * volatile _display_entry_now;
+_display_entry * volatile _display_start;
+_display_entry * volatile _display_end;
+
+/* 
+ *   A blank frame stops the display interrupt until the next frame is due,
+ *   and a frame with DISPLAY_SLOW_LENGTH or fewer lit LED colors runs it 8
+ *   times slower, which still refreshes them over 300 times a second.
+ */
+#define DISPLAY_SLOW_LENGTH 3
+volatile bool _display_idle = false;
+
+/* queue statistics, reset by printFrameProfile() */
+unsigned int frame_underruns = 0;    // frames flushed after their presentation time
+volatile unsigned int frames_dropped = 0;  // frames replaced before they were shown
+byte frame_queue_peak = 0;           // most frames waiting at once
 
 /* _cube_buffer is the array of characters that will control all the LEDs in the cube. */
 char * _cube_buffer;
 
+/*
+ *   _cube_mask has a bit set for every LED of each color plane that may be
+ *   lit in _cube_buffer. A clear bit always means the LED is off, but a set
+ *   bit can be left behind when something dims an LED back to 0, so
+ *   flushBuffer() still checks the level. The drawing functions call
+ *   markLit() for every LED they add to, clearBuffer() clears the masks,
+ *   and code that writes _cube_buffer itself has to do the same.
+ */
+CubeMask _cube_mask[3];
+
+inline void markLit(const char * buffer, byte index) {
+  if (buffer == _cube_buffer) maskSet(_cube_mask[index >> 6], index);
+}
+
+inline void clearLit(const char * buffer) {
+  if (buffer == _cube_buffer) _cube_mask[0] = _cube_mask[1] = _cube_mask[2] = 0;
+}
+
 bool continuePattern = false;
 
+/* Which of the red, green and blue planes each drawLed() color lights up. */
+const byte _color_planes[] = {0x01,0x02,0x04,0x03,0x06,0x05,0x07};
+
+/*------------------------------- FRAME PROFILE -----------------------------*/
+/*
+ *   Building with CUBE_PROFILE defined times every frame from clearBuffer()
+ *   to the end of flushBuffer(), so the cost of drawing a frame can be
+ *   compared between patterns. Time flushBuffer() spends waiting for room
+ *   in the queue is left out, since that is sleep and not drawing. The
+ *   display interrupt still runs while measuring, so the numbers include
+ *   the time it steals.
+ */
+/*---------------------------------------------------------------------------*/
+#ifdef CUBE_PROFILE
+unsigned long _profile_frame_start = 0;
+unsigned long _profile_frame_us = 0;
+unsigned long _profile_frames = 0;
+#define PROFILE_FRAME_BEGIN() _profile_frame_start = micros()
+#define PROFILE_FRAME_END() { _profile_frame_us += micros() - _profile_frame_start; _profile_frames++; }
+#define PROFILE_WAIT_BEGIN() unsigned long _wait_start = micros()
+#define PROFILE_WAIT_END() _profile_frame_start += micros() - _wait_start
+
+/*
+ *   The time the main loop spends in idleSleep() is counted in 4us Timer1
+ *   steps. The interrupt that wakes it runs before it gets going again, so
+ *   this is how busy the main loop is, and interrupts are counted apart:
+ *   the display steps are counted to show what the idle display saves.
+ */
+unsigned long _profile_asleep = 0;
+unsigned long _profile_since = 0;
+volatile unsigned long _profile_display_steps = 0;
+unsigned long _profileClock() {  // call with interrupts off
+  unsigned long ticks = _timer_ticks;
+  unsigned int count = TCNT1;
+  if ((TIFR1 & (1<<OCF1A)) && count < 125) ticks++;  // the tick has not been counted yet
+  return ticks*250 + count;
+}
+/*
+ *   The interrupts that run while the main loop sleeps keep the CPU awake
+ *   too, and the sleep count does not see them. To estimate the CPU's awake
+ *   time, every interrupt that falls in the sleep time is charged a stated
+ *   number of cycles, its handler plus about 40 cycles to wake up. These
+ *   are the same guesses tools/sim/Arduino.h uses, not measurements, so the
+ *   figure agreeing with cubesim only shows the two use one model. The
+ *   interrupts are taken to fall evenly over the busy and asleep time.
+ */
+#define PROFILE_STEP_CYCLES   115   // one display step, Timer2
+#define PROFILE_TICK_CYCLES   110   // cubetimer.h tick, Timer1, 1000 a second
+#define PROFILE_MILLIS_CYCLES 120   // the core's millis(), Timer0, every 1024us
+#define PROFILE_CLOCK_CYCLES  (F_CPU / 250000L)   // cycles in one _profileClock() step
+
+unsigned long _profileAwake(unsigned long elapsed, unsigned long steps) {
+  uint64_t interrupts = (uint64_t)steps * PROFILE_STEP_CYCLES
+                      + (uint64_t)(elapsed / 250) * PROFILE_TICK_CYCLES
+                      + (uint64_t)(elapsed / 256) * PROFILE_MILLIS_CYCLES;
+  interrupts /= PROFILE_CLOCK_CYCLES;
+  if (interrupts > elapsed) interrupts = elapsed;
+  unsigned long asleepInInterrupts = (uint64_t)_profile_asleep * interrupts / elapsed;
+  return elapsed - _profile_asleep + asleepInInterrupts;
+}
+
+#define PROFILE_SLEEP_BEGIN() unsigned long _sleep_start = _profileClock()
+#define PROFILE_DISPLAY_STEP() _profile_display_steps++
+#define PROFILE_SLEEP_END() { cli(); _profile_asleep += _profileClock() - _sleep_start; sei(); }
+
+/* With CUBE_FRAME_LOG, what writing the frame log costs flushBuffer(). */
+unsigned long _profile_log_us = 0;
+unsigned int _profile_log_records = 0;
+unsigned long _profile_log_bytes = 0;
+#define PROFILE_LOG_BEGIN() unsigned long _log_start = micros()
+#define PROFILE_LOG_END(length) { \
+  _profile_log_us += micros() - _log_start; \
+  if (length) { _profile_log_records++; _profile_log_bytes += length; } }
+
+void printFrameProfile(const char * label) {
+  Serial.print(label);
+  Serial.print(F(": "));
+  if (_profile_frames > 0) {
+    Serial.print(_profile_frame_us / _profile_frames);
+    Serial.print(F("us ("));
+    Serial.print((_profile_frame_us / _profile_frames) * (F_CPU / 1000000L));
+    Serial.print(F(" cycles) per frame over "));
+    Serial.print(_profile_frames);
+    Serial.println(F(" frames"));
+  }
+  else {
+    Serial.println(F("no frames"));
+  }
+  cli();   // the display interrupt counts drops, so none are lost between the copy and the reset
+  unsigned int dropped = frames_dropped;
+  frames_dropped = 0;
+  sei();
+  Serial.print(F("  queue peak "));
+  Serial.print(frame_queue_peak);
+  Serial.print(F(" of "));
+  Serial.print(FRAME_QUEUE_SLOTS-1);
+  Serial.print(F(", "));
+  Serial.print(frame_underruns);
+  Serial.print(F(" late, "));
+  Serial.print(dropped);
+  Serial.println(F(" dropped"));
+  cli();
+  unsigned long now = _profileClock();
+  unsigned long steps = _profile_display_steps;
+  _profile_display_steps = 0;
+  sei();
+  unsigned long elapsed = now - _profile_since;
+  if (elapsed > 0) {
+    Serial.print(F("  main loop busy "));
+    Serial.print(100 - (_profile_asleep * 100) / elapsed);
+    Serial.print(F("%, CPU awake about "));
+    Serial.print((unsigned long)((uint64_t)_profileAwake(elapsed, steps) * 100 / elapsed));
+    Serial.print(F("%, "));
+    Serial.print((steps * 250) / (elapsed / 1000 + 1));
+    Serial.println(F(" display steps/s"));
+  }
+#ifdef CUBE_FRAME_LOG
+  if (_profile_frames > 0) {
+    Serial.print(F("  log "));
+    Serial.print(_profile_log_us / _profile_frames);
+    Serial.print(F("us per frame, "));
+    Serial.print(_profile_log_records);
+    Serial.print(F(" records, "));
+    Serial.print(_profile_log_bytes);
+    Serial.println(F(" bytes"));
+  }
+  _profile_log_us = 0;
+  _profile_log_records = 0;
+  _profile_log_bytes = 0;
+#endif
+  _profile_since = now;
+  _profile_asleep = 0;
+  frame_queue_peak = 0;
+  frame_underruns = 0;
+  _profile_frame_us = 0;
+  _profile_frames = 0;
+  PROFILE_FRAME_BEGIN();
+}
+#else
+#define PROFILE_FRAME_BEGIN()
+#define PROFILE_FRAME_END()
+#define PROFILE_WAIT_BEGIN()
+#define PROFILE_WAIT_END()
+#define PROFILE_SLEEP_BEGIN()
+#define PROFILE_SLEEP_END()
+#define PROFILE_DISPLAY_STEP()
+#define PROFILE_LOG_BEGIN()
+#define PROFILE_LOG_END(length)
+#define printFrameProfile(label)
+#endif
+
+/*--------------------------------- FRAME LOG -------------------------------*/
+/*
+ *   Building with CUBE_FRAME_LOG defined sends every flushed frame to the
+ *   serial port as a cubelog.h record, for tools/cubeplay.cpp. A record is
+ *   only written when it fits in what is free of the serial transmit
+ *   buffer, so logging never waits for the port and the display interrupt
+ *   is never held up by it. Frames that find no room are folded into the
+ *   next one logged, and a frame with more changes than fit is kept in
+ *   the log and sent over the next records, leaving out the frames flushed
+ *   meanwhile, so at 9600 baud the log shows fewer frames, never wrong
+ *   ones. Keeping that copy costs about 130 bytes of SRAM. FRAME_LOG_ROOM
+ *   limits a record, and with it the time taken, to (FRAME_LOG_ROOM-5)*2/3
+ *   changes on top of one look at each lit LED.
+ *   Opening the port resets the cube, so a log starts from a dark cube like
+ *   the player does.
+ */
+/*---------------------------------------------------------------------------*/
+#ifdef CUBE_FRAME_LOG
+#ifndef FRAME_LOG_ROOM
+  #define FRAME_LOG_ROOM 48
+#endif
+CubeLog _frame_log;
+
+void _logFrame(unsigned long pts) {
+  PROFILE_LOG_BEGIN();
+  byte record[FRAME_LOG_ROOM];
+  unsigned int room = Serial.availableForWrite();
+  if (room > FRAME_LOG_ROOM) room = FRAME_LOG_ROOM;
+  unsigned int length = encodeFrame(_frame_log, pts, _cube_buffer, _cube_mask, record, room);
+  if (length) Serial.write(record, length);
+  PROFILE_LOG_END(length);
+}
+#else
+#define _logFrame(pts)
+#endif
+
 /*----------------------------------- INIT CUBE ------------------------------*/
 /*
  *   This function will allocate the memory required for the LED cube buffers,
- *   which is about 600bytes.
+ *   which is about 1KB with the default FRAME_ENTRIES.
  *   
  *   Inspired by Asher Glick's Charliecube and utilizes his helper header niceTimer.h
  */
 /*---------------------------------------------------------------------------*/
 void initCube() {
-  _cube__frame = (_frame_light*)malloc(sizeof(_frame_light) * (BUFFERSIZE+1));
+  _frame_entries = (_display_entry*)malloc(sizeof(_display_entry) * FRAME_ENTRIES);
+  _pool_end = _frame_entries + FRAME_ENTRIES;
   _cube_buffer = (char*)malloc(sizeof(char) * BUFFERSIZE);
   
   
   for (int i = 0; i < BUFFERSIZE; i++) {
     _cube_buffer[i] = 0;
   }
-  _cube__frame->next = _cube__frame;
-  _cube__frame->pin1=0;
-  _cube__frame->pin2=0;
-  _cube_current_frame = _cube__frame;
+  clearLit(_cube_buffer);
+#ifdef CUBE_FRAME_LOG
+  resetLog(_frame_log);
+#endif
+  // start on a blank frame of one unlit entry
+  _frame_entries[0].pins = 0;
+  _frame_entries[0].brightness = 0;
+  _frame_queue[0].start = _frame_entries;
+  _frame_queue[0].end = _frame_entries + 1;
+  _frame_queue[0].pts = 0;
+  _frame_queue[0].lit = 0;
+  _display_entry_now = _display_start = _frame_entries;
+  _display_end = _frame_entries + 1;
  
   
-  // Configure Interrupt for color display
+  loadLedTrim();
+
+  // Configure Interrupt for color display, which starts idle on the blank
+  // frame and is started by the first frame flushed
   setTimer2Prescaler(1);
-  enableTimer2OverflowInterrupt();
   setTimer2Mode (TIMER2_NORMAL);
+  _display_idle = true;
   
-  // Configure Interrupt for Animation Progression
-  setTimer1Prescaler(256);
-  enableTimer1OverflowInterrupt();
-  setTimer1Mode (TIMER1_NORMAL);  
+  // Configure the 1ms software timer tick for Animation Progression
+  initTimers();
+}
+
+/*------------------------------- PATTERN TIMER -----------------------------*/
+/*
+ *   Starts a one shot timer that sets continuePattern to false after
+ *   duration milliseconds, which is how every pattern knows when to end.
+ *   Starting a new one cancels the previous pattern's timer if it is still
+ *   running.
+ */
+/*---------------------------------------------------------------------------*/
+byte _pattern_timer = TIMER_NONE;
+
+void _endPattern() {
+  continuePattern = false;
+  _pattern_timer = TIMER_NONE;
+}
+
+void startPatternTimer(unsigned int duration) {
+  cancelTimer(_pattern_timer);
+  continuePattern = true;
+  _pattern_timer = startTimer(duration, _endPattern);
+}
+
+/*-------------------------------- IDLE SLEEP -------------------------------*/
+/*
+ *   Puts the CPU in SLEEP_MODE_IDLE until the next interrupt. The timers and
+ *   the serial port keep running in idle mode, so it wakes up for the next
+ *   millisecond tick, display step or serial byte, and does not go to sleep
+ *   at all if a timer callback is already waiting. Inside a callback the
+ *   waiting ones cannot run until it returns, so then it sleeps anyway. Bytes that are waiting
+ *   in the serial buffer do not keep it awake: they are picked up by a
+ *   timer, see serviceSerial() in the sketch. The Arduino core calls
+ *   yield() while it waits in delay(), so every delay() sleeps instead of
+ *   spinning.
+ */
+/*---------------------------------------------------------------------------*/
+void idleSleep() {
+  set_sleep_mode(SLEEP_MODE_IDLE);
+  cli();
+  if (_timer_pending && !_timer_servicing) {
+    sei();
+    return;
+  }
+  PROFILE_SLEEP_BEGIN();
+  sleep_enable();
+  sei();        // the instruction after sei() always runs, so no wakeup is missed
+  sleep_cpu();
+  sleep_disable();
+  PROFILE_SLEEP_END();
+}
+
+void yield() {
+  serviceTimers();
+  idleSleep();
 }
 
 /*-------------------------------- CLEAR BUFFER -----------------------------*/
@@ -76,6 +403,8 @@ void clearBuffer () {
   for (int i = 0; i < BUFFERSIZE; i++) {
     _cube_buffer[i] = 0;
   }
+  clearLit(_cube_buffer);
+  PROFILE_FRAME_BEGIN();
 }
 
 /*---------------------------------- SWAP INT -------------------------------*/
@@ -92,229 +421,102 @@ void swapint(int & one, int & two) {
 
 /*------------------------------- FLUSH BUFFER ------------------------------*/
 /*
- *   This takes the buffer frame and sets the display memory to match, because 
- *   the display memory needs to be faster it is split up into two arrays instead
- *   of just one. The display frame is actually a cyclic linked list which allows 
- *   the program to just loop through and turn on the LEDs without the need to 
- *   check to see if it is at the end of the loop.
+ *   This takes the buffer frame and queues a display frame that matches it,
+ *   to be shown at timerMillis() pts. The display frame only holds the LEDs
+ *   that are lit, as pin pairs from cube_pins[], so the interrupt can just
+ *   loop through and turn on the LEDs without checking the rest. Brightness
+ *   is gamma corrected here, with cube_gamma[] from cubegamma.h. Only the
+ *   LEDs set in _cube_mask are visited, so a sparse frame costs a few steps
+ *   per lit LED instead of a pass over all 192.
+ *
+ *   If the queue is full, or the pool has no room for the frame, this waits
+ *   for the display to move on. frameQueueRoom() tells the main loop ahead
+ *   of time whether a frame of so many lit LED colors would have to wait,
+ *   display_length is how many the last one had.
  *   
  *   Inspired by Asher Glick's Charliecube and utilizes his helper header niceTimer.h
  */
 /*---------------------------------------------------------------------------*/
 int pwmm = 0;
 int display_length;
-void flushElement(_frame_light* &copy_frame,int pin1,int pin2,int brightness) {
-  pin1--;
-  pin2--;
-  
-  (copy_frame+1)->next=copy_frame;
-  copy_frame++;
-  copy_frame->pin1=pin1 | ( brightness & 0xF0);
-  copy_frame->pin2=pin2 | ((brightness & 0x0F) << 4);
-  display_length++;
+
+byte frameQueueDepth() {
+  return (byte)(_queue_head - _queue_tail - 1);
 }
 
-void flushBuffer() {
-  _frame_light * copy_frame = _cube__frame;
+bool frameQueueFull() {
+  return (byte)(_queue_head - _queue_tail) >= FRAME_QUEUE_SLOTS;
+}
+
+/* The pool is a ring, so a frame may run over the end of it and carry on at the start. */
+int _freeEntries() {
+  _display_entry * write = _frame_queue[(_queue_head-1) & FRAME_QUEUE_MASK].end;
+  _display_entry * live = _frame_queue[_queue_tail & FRAME_QUEUE_MASK].start;
+  int count = live - write;
+  if (count < 0) count += FRAME_ENTRIES;
+  return count;
+}
+
+bool frameQueueRoom(int lit) {
+  if (lit < 1) lit = 1;   // a dark frame still takes one entry
+  return !frameQueueFull() && _freeEntries() >= lit;
+}
+
+void _queueFrame(unsigned long pts) {
+  int length = maskCount(_cube_mask[0]) + maskCount(_cube_mask[1]) + maskCount(_cube_mask[2]);
+
+  PROFILE_WAIT_BEGIN();
+  while (!frameQueueRoom(length)) {
+    yield();
+  }
+  PROFILE_WAIT_END();
+
+  _display_entry * start = _frame_queue[(_queue_head-1) & FRAME_QUEUE_MASK].end;
+  _display_entry * entry = start;
   display_length = 0;
+  for (byte plane = 0; plane < 3; plane++) {
+    CubeMask marked = _cube_mask[plane];
+    byte base = plane * 64;
+    while (marked) {
+      byte i = base + maskNext(marked);
+      byte level = _cube_buffer[i];
+      if (level == 0) continue;   // marked, but dimmed back to off
+      if (level > GAMMA_MAX) level = GAMMA_MAX;
+      entry->pins = pgm_read_byte(&cube_pins[i]);
+      entry->brightness = pgm_read_byte(&cube_gamma[getLedTrim(i)][plane][level]);
+      if (++entry == _pool_end) entry = _frame_entries;
+      display_length++;
+    }
+  }
+  if (display_length == 0) {
+    entry->pins = 0;
+    entry->brightness = 0;
+    if (++entry == _pool_end) entry = _frame_entries;
+  }
+
+  byte depth = frameQueueDepth() + 1;
+  if (depth > frame_queue_peak) frame_queue_peak = depth;
 
-  if (_cube_buffer[  0] != 0)flushElement(copy_frame, 4, 8,_cube_buffer[  0]);
-  if (_cube_buffer[  1] != 0)flushElement(copy_frame,16, 4,_cube_buffer[  1]);
-  if (_cube_buffer[  2] != 0)flushElement(copy_frame,12,16,_cube_buffer[  2]);
-  if (_cube_buffer[  3] != 0)flushElement(copy_frame, 8,12,_cube_buffer[  3]);
-  if (_cube_buffer[  4] != 0)flushElement(copy_frame, 4, 7,_cube_buffer[  4]);
-  if (_cube_buffer[  5] != 0)flushElement(copy_frame,13, 4,_cube_buffer[  5]);
-  if (_cube_buffer[  6] != 0)flushElement(copy_frame,11,13,_cube_buffer[  6]);
-  if (_cube_buffer[  7] != 0)flushElement(copy_frame, 7,11,_cube_buffer[  7]);
-  if (_cube_buffer[  8] != 0)flushElement(copy_frame, 4, 6,_cube_buffer[  8]);
-  if (_cube_buffer[  9] != 0)flushElement(copy_frame,15, 4,_cube_buffer[  9]);
-  if (_cube_buffer[ 10] != 0)flushElement(copy_frame,10,15,_cube_buffer[ 10]);
-  if (_cube_buffer[ 11] != 0)flushElement(copy_frame, 6,10,_cube_buffer[ 11]);
-  if (_cube_buffer[ 12] != 0)flushElement(copy_frame, 4, 5,_cube_buffer[ 12]);
-  if (_cube_buffer[ 13] != 0)flushElement(copy_frame,14, 4,_cube_buffer[ 13]);
-  if (_cube_buffer[ 14] != 0)flushElement(copy_frame, 9,14,_cube_buffer[ 14]);
-  if (_cube_buffer[ 15] != 0)flushElement(copy_frame, 5, 9,_cube_buffer[ 15]);
-  if (_cube_buffer[ 16] != 0)flushElement(copy_frame, 3, 8,_cube_buffer[ 16]);
-  if (_cube_buffer[ 17] != 0)flushElement(copy_frame,15, 3,_cube_buffer[ 17]);
-  if (_cube_buffer[ 18] != 0)flushElement(copy_frame,11,15,_cube_buffer[ 18]);
-  if (_cube_buffer[ 19] != 0)flushElement(copy_frame, 8,11,_cube_buffer[ 19]);
-  if (_cube_buffer[ 20] != 0)flushElement(copy_frame, 3, 7,_cube_buffer[ 20]);
-  if (_cube_buffer[ 21] != 0)flushElement(copy_frame,14, 3,_cube_buffer[ 21]);
-  if (_cube_buffer[ 22] != 0)flushElement(copy_frame,12,14,_cube_buffer[ 22]);
-  if (_cube_buffer[ 23] != 0)flushElement(copy_frame, 7,12,_cube_buffer[ 23]);
-  if (_cube_buffer[ 24] != 0)flushElement(copy_frame, 3, 6,_cube_buffer[ 24]);
-  if (_cube_buffer[ 25] != 0)flushElement(copy_frame,16, 3,_cube_buffer[ 25]);
-  if (_cube_buffer[ 26] != 0)flushElement(copy_frame, 9,16,_cube_buffer[ 26]);
-  if (_cube_buffer[ 27] != 0)flushElement(copy_frame, 6, 9,_cube_buffer[ 27]);
-  if (_cube_buffer[ 28] != 0)flushElement(copy_frame, 3, 5,_cube_buffer[ 28]);
-  if (_cube_buffer[ 29] != 0)flushElement(copy_frame,13, 3,_cube_buffer[ 29]);
-  if (_cube_buffer[ 30] != 0)flushElement(copy_frame,10,13,_cube_buffer[ 30]);
-  if (_cube_buffer[ 31] != 0)flushElement(copy_frame, 5,10,_cube_buffer[ 31]);
-  if (_cube_buffer[ 32] != 0)flushElement(copy_frame, 2, 8,_cube_buffer[ 32]);
-  if (_cube_buffer[ 33] != 0)flushElement(copy_frame,14, 2,_cube_buffer[ 33]);
-  if (_cube_buffer[ 34] != 0)flushElement(copy_frame,10,14,_cube_buffer[ 34]);
-  if (_cube_buffer[ 35] != 0)flushElement(copy_frame, 8,10,_cube_buffer[ 35]);
-  if (_cube_buffer[ 36] != 0)flushElement(copy_frame, 2, 7,_cube_buffer[ 36]);
-  if (_cube_buffer[ 37] != 0)flushElement(copy_frame,15, 2,_cube_buffer[ 37]);
-  if (_cube_buffer[ 38] != 0)flushElement(copy_frame, 9,15,_cube_buffer[ 38]);
-  if (_cube_buffer[ 39] != 0)flushElement(copy_frame, 7, 9,_cube_buffer[ 39]);
-  if (_cube_buffer[ 40] != 0)flushElement(copy_frame, 2, 6,_cube_buffer[ 40]);
-  if (_cube_buffer[ 41] != 0)flushElement(copy_frame,13, 2,_cube_buffer[ 41]);
-  if (_cube_buffer[ 42] != 0)flushElement(copy_frame,12,13,_cube_buffer[ 42]);
-  if (_cube_buffer[ 43] != 0)flushElement(copy_frame, 6,12,_cube_buffer[ 43]);
-  if (_cube_buffer[ 44] != 0)flushElement(copy_frame, 2, 5,_cube_buffer[ 44]);
-  if (_cube_buffer[ 45] != 0)flushElement(copy_frame,16, 2,_cube_buffer[ 45]);
-  if (_cube_buffer[ 46] != 0)flushElement(copy_frame,11,16,_cube_buffer[ 46]);
-  if (_cube_buffer[ 47] != 0)flushElement(copy_frame, 5,11,_cube_buffer[ 47]);
-  if (_cube_buffer[ 48] != 0)flushElement(copy_frame, 1, 8,_cube_buffer[ 48]);
-  if (_cube_buffer[ 49] != 0)flushElement(copy_frame,13, 1,_cube_buffer[ 49]);
-  if (_cube_buffer[ 50] != 0)flushElement(copy_frame, 9,13,_cube_buffer[ 50]);
-  if (_cube_buffer[ 51] != 0)flushElement(copy_frame, 8, 9,_cube_buffer[ 51]);
-  if (_cube_buffer[ 52] != 0)flushElement(copy_frame, 1, 7,_cube_buffer[ 52]);
-  if (_cube_buffer[ 53] != 0)flushElement(copy_frame,16, 1,_cube_buffer[ 53]);
-  if (_cube_buffer[ 54] != 0)flushElement(copy_frame,10,16,_cube_buffer[ 54]);
-  if (_cube_buffer[ 55] != 0)flushElement(copy_frame, 7,10,_cube_buffer[ 55]);
-  if (_cube_buffer[ 56] != 0)flushElement(copy_frame, 1, 6,_cube_buffer[ 56]);
-  if (_cube_buffer[ 57] != 0)flushElement(copy_frame,14, 1,_cube_buffer[ 57]);
-  if (_cube_buffer[ 58] != 0)flushElement(copy_frame,11,14,_cube_buffer[ 58]);
-  if (_cube_buffer[ 59] != 0)flushElement(copy_frame, 6,11,_cube_buffer[ 59]);
-  if (_cube_buffer[ 60] != 0)flushElement(copy_frame, 1, 5,_cube_buffer[ 60]);
-  if (_cube_buffer[ 61] != 0)flushElement(copy_frame,15, 1,_cube_buffer[ 61]);
-  if (_cube_buffer[ 62] != 0)flushElement(copy_frame,12,15,_cube_buffer[ 62]);
-  if (_cube_buffer[ 63] != 0)flushElement(copy_frame, 5,12,_cube_buffer[ 63]);
-  if (_cube_buffer[ 64] != 0)flushElement(copy_frame,16, 8,_cube_buffer[ 64]);
-  if (_cube_buffer[ 65] != 0)flushElement(copy_frame,12, 4,_cube_buffer[ 65]);
-  if (_cube_buffer[ 66] != 0)flushElement(copy_frame, 8,16,_cube_buffer[ 66]);
-  if (_cube_buffer[ 67] != 0)flushElement(copy_frame, 4,12,_cube_buffer[ 67]);
-  if (_cube_buffer[ 68] != 0)flushElement(copy_frame,13, 7,_cube_buffer[ 68]);
-  if (_cube_buffer[ 69] != 0)flushElement(copy_frame,11, 4,_cube_buffer[ 69]);
-  if (_cube_buffer[ 70] != 0)flushElement(copy_frame, 7,13,_cube_buffer[ 70]);
-  if (_cube_buffer[ 71] != 0)flushElement(copy_frame, 4,11,_cube_buffer[ 71]);
-  if (_cube_buffer[ 72] != 0)flushElement(copy_frame,15, 6,_cube_buffer[ 72]);
-  if (_cube_buffer[ 73] != 0)flushElement(copy_frame,10, 4,_cube_buffer[ 73]);
-  if (_cube_buffer[ 74] != 0)flushElement(copy_frame, 6,15,_cube_buffer[ 74]);
-  if (_cube_buffer[ 75] != 0)flushElement(copy_frame, 4,10,_cube_buffer[ 75]);
-  if (_cube_buffer[ 76] != 0)flushElement(copy_frame,14, 5,_cube_buffer[ 76]);
-  if (_cube_buffer[ 77] != 0)flushElement(copy_frame, 9, 4,_cube_buffer[ 77]);
-  if (_cube_buffer[ 78] != 0)flushElement(copy_frame, 5,14,_cube_buffer[ 78]);
-  if (_cube_buffer[ 79] != 0)flushElement(copy_frame, 4, 9,_cube_buffer[ 79]);
-  if (_cube_buffer[ 80] != 0)flushElement(copy_frame,15, 8,_cube_buffer[ 80]);
-  if (_cube_buffer[ 81] != 0)flushElement(copy_frame,11, 3,_cube_buffer[ 81]);
-  if (_cube_buffer[ 82] != 0)flushElement(copy_frame, 8,15,_cube_buffer[ 82]);
-  if (_cube_buffer[ 83] != 0)flushElement(copy_frame, 3,11,_cube_buffer[ 83]);
-  if (_cube_buffer[ 84] != 0)flushElement(copy_frame,14, 7,_cube_buffer[ 84]);
-  if (_cube_buffer[ 85] != 0)flushElement(copy_frame,12, 3,_cube_buffer[ 85]);
-  if (_cube_buffer[ 86] != 0)flushElement(copy_frame, 7,14,_cube_buffer[ 86]);
-  if (_cube_buffer[ 87] != 0)flushElement(copy_frame, 3,12,_cube_buffer[ 87]);
-  if (_cube_buffer[ 88] != 0)flushElement(copy_frame,16, 6,_cube_buffer[ 88]);
-  if (_cube_buffer[ 89] != 0)flushElement(copy_frame, 9, 3,_cube_buffer[ 89]);
-  if (_cube_buffer[ 90] != 0)flushElement(copy_frame, 6,16,_cube_buffer[ 90]);
-  if (_cube_buffer[ 91] != 0)flushElement(copy_frame, 3, 9,_cube_buffer[ 91]);
-  if (_cube_buffer[ 92] != 0)flushElement(copy_frame,13, 5,_cube_buffer[ 92]);
-  if (_cube_buffer[ 93] != 0)flushElement(copy_frame,10, 3,_cube_buffer[ 93]);
-  if (_cube_buffer[ 94] != 0)flushElement(copy_frame, 5,13,_cube_buffer[ 94]);
-  if (_cube_buffer[ 95] != 0)flushElement(copy_frame, 3,10,_cube_buffer[ 95]);
-  if (_cube_buffer[ 96] != 0)flushElement(copy_frame,14, 8,_cube_buffer[ 96]);
-  if (_cube_buffer[ 97] != 0)flushElement(copy_frame,10, 2,_cube_buffer[ 97]);
-  if (_cube_buffer[ 98] != 0)flushElement(copy_frame, 8,14,_cube_buffer[ 98]);
-  if (_cube_buffer[ 99] != 0)flushElement(copy_frame, 2,10,_cube_buffer[ 99]);
-  if (_cube_buffer[100] != 0)flushElement(copy_frame,15, 7,_cube_buffer[100]);
-  if (_cube_buffer[101] != 0)flushElement(copy_frame, 9, 2,_cube_buffer[101]);
-  if (_cube_buffer[102] != 0)flushElement(copy_frame, 7,15,_cube_buffer[102]);
-  if (_cube_buffer[103] != 0)flushElement(copy_frame, 2, 9,_cube_buffer[103]);
-  if (_cube_buffer[104] != 0)flushElement(copy_frame,13, 6,_cube_buffer[104]);
-  if (_cube_buffer[105] != 0)flushElement(copy_frame,12, 2,_cube_buffer[105]);
-  if (_cube_buffer[106] != 0)flushElement(copy_frame, 6,13,_cube_buffer[106]);
-  if (_cube_buffer[107] != 0)flushElement(copy_frame, 2,12,_cube_buffer[107]);
-  if (_cube_buffer[108] != 0)flushElement(copy_frame,16, 5,_cube_buffer[108]);
-  if (_cube_buffer[109] != 0)flushElement(copy_frame,11, 2,_cube_buffer[109]);
-  if (_cube_buffer[110] != 0)flushElement(copy_frame, 5,16,_cube_buffer[110]);
-  if (_cube_buffer[111] != 0)flushElement(copy_frame, 2,11,_cube_buffer[111]);
-  if (_cube_buffer[112] != 0)flushElement(copy_frame,13, 8,_cube_buffer[112]);
-  if (_cube_buffer[113] != 0)flushElement(copy_frame, 9, 1,_cube_buffer[113]);
-  if (_cube_buffer[114] != 0)flushElement(copy_frame, 8,13,_cube_buffer[114]);
-  if (_cube_buffer[115] != 0)flushElement(copy_frame, 1, 9,_cube_buffer[115]);
-  if (_cube_buffer[116] != 0)flushElement(copy_frame,16, 7,_cube_buffer[116]);
-  if (_cube_buffer[117] != 0)flushElement(copy_frame,10, 1,_cube_buffer[117]);
-  if (_cube_buffer[118] != 0)flushElement(copy_frame, 7,16,_cube_buffer[118]);
-  if (_cube_buffer[119] != 0)flushElement(copy_frame, 1,10,_cube_buffer[119]);
-  if (_cube_buffer[120] != 0)flushElement(copy_frame,14, 6,_cube_buffer[120]);
-  if (_cube_buffer[121] != 0)flushElement(copy_frame,11, 1,_cube_buffer[121]);
-  if (_cube_buffer[122] != 0)flushElement(copy_frame, 6,14,_cube_buffer[122]);
-  if (_cube_buffer[123] != 0)flushElement(copy_frame, 1,11,_cube_buffer[123]);
-  if (_cube_buffer[124] != 0)flushElement(copy_frame,15, 5,_cube_buffer[124]);
-  if (_cube_buffer[125] != 0)flushElement(copy_frame,12, 1,_cube_buffer[125]);
-  if (_cube_buffer[126] != 0)flushElement(copy_frame, 5,15,_cube_buffer[126]);
-  if (_cube_buffer[127] != 0)flushElement(copy_frame, 1,12,_cube_buffer[127]);
-  if (_cube_buffer[128] != 0)flushElement(copy_frame,12, 8,_cube_buffer[128]);
-  if (_cube_buffer[129] != 0)flushElement(copy_frame, 8, 4,_cube_buffer[129]);
-  if (_cube_buffer[130] != 0)flushElement(copy_frame, 4,16,_cube_buffer[130]);
-  if (_cube_buffer[131] != 0)flushElement(copy_frame,16,12,_cube_buffer[131]);
-  if (_cube_buffer[132] != 0)flushElement(copy_frame,11, 7,_cube_buffer[132]);
-  if (_cube_buffer[133] != 0)flushElement(copy_frame, 7, 4,_cube_buffer[133]);
-  if (_cube_buffer[134] != 0)flushElement(copy_frame, 4,13,_cube_buffer[134]);
-  if (_cube_buffer[135] != 0)flushElement(copy_frame,13,11,_cube_buffer[135]);
-  if (_cube_buffer[136] != 0)flushElement(copy_frame,10, 6,_cube_buffer[136]);
-  if (_cube_buffer[137] != 0)flushElement(copy_frame, 6, 4,_cube_buffer[137]);
-  if (_cube_buffer[138] != 0)flushElement(copy_frame, 4,15,_cube_buffer[138]);
-  if (_cube_buffer[139] != 0)flushElement(copy_frame,15,10,_cube_buffer[139]);
-  if (_cube_buffer[140] != 0)flushElement(copy_frame, 9, 5,_cube_buffer[140]);
-  if (_cube_buffer[141] != 0)flushElement(copy_frame, 5, 4,_cube_buffer[141]);
-  if (_cube_buffer[142] != 0)flushElement(copy_frame, 4,14,_cube_buffer[142]);
-  if (_cube_buffer[143] != 0)flushElement(copy_frame,14, 9,_cube_buffer[143]);
-  if (_cube_buffer[144] != 0)flushElement(copy_frame,11, 8,_cube_buffer[144]);
-  if (_cube_buffer[145] != 0)flushElement(copy_frame, 8, 3,_cube_buffer[145]);
-  if (_cube_buffer[146] != 0)flushElement(copy_frame, 3,15,_cube_buffer[146]);
-  if (_cube_buffer[147] != 0)flushElement(copy_frame,15,11,_cube_buffer[147]);
-  if (_cube_buffer[148] != 0)flushElement(copy_frame,12, 7,_cube_buffer[148]);
-  if (_cube_buffer[149] != 0)flushElement(copy_frame, 7, 3,_cube_buffer[149]);
-  if (_cube_buffer[150] != 0)flushElement(copy_frame, 3,14,_cube_buffer[150]);
-  if (_cube_buffer[151] != 0)flushElement(copy_frame,14,12,_cube_buffer[151]);
-  if (_cube_buffer[152] != 0)flushElement(copy_frame, 9, 6,_cube_buffer[152]);
-  if (_cube_buffer[153] != 0)flushElement(copy_frame, 6, 3,_cube_buffer[153]);
-  if (_cube_buffer[154] != 0)flushElement(copy_frame, 3,16,_cube_buffer[154]);
-  if (_cube_buffer[155] != 0)flushElement(copy_frame,16, 9,_cube_buffer[155]);
-  if (_cube_buffer[156] != 0)flushElement(copy_frame,10, 5,_cube_buffer[156]);
-  if (_cube_buffer[157] != 0)flushElement(copy_frame, 5, 3,_cube_buffer[157]);
-  if (_cube_buffer[158] != 0)flushElement(copy_frame, 3,13,_cube_buffer[158]);
-  if (_cube_buffer[159] != 0)flushElement(copy_frame,13,10,_cube_buffer[159]);
-  if (_cube_buffer[160] != 0)flushElement(copy_frame,10, 8,_cube_buffer[160]);
-  if (_cube_buffer[161] != 0)flushElement(copy_frame, 8, 2,_cube_buffer[161]);
-  if (_cube_buffer[162] != 0)flushElement(copy_frame, 2,14,_cube_buffer[162]);
-  if (_cube_buffer[163] != 0)flushElement(copy_frame,14,10,_cube_buffer[163]);
-  if (_cube_buffer[164] != 0)flushElement(copy_frame, 9, 7,_cube_buffer[164]);
-  if (_cube_buffer[165] != 0)flushElement(copy_frame, 7, 2,_cube_buffer[165]);
-  if (_cube_buffer[166] != 0)flushElement(copy_frame, 2,15,_cube_buffer[166]);
-  if (_cube_buffer[167] != 0)flushElement(copy_frame,15, 9,_cube_buffer[167]);
-  if (_cube_buffer[168] != 0)flushElement(copy_frame,12, 6,_cube_buffer[168]);
-  if (_cube_buffer[169] != 0)flushElement(copy_frame, 6, 2,_cube_buffer[169]);
-  if (_cube_buffer[170] != 0)flushElement(copy_frame, 2,13,_cube_buffer[170]);
-  if (_cube_buffer[171] != 0)flushElement(copy_frame,13,12,_cube_buffer[171]);
-  if (_cube_buffer[172] != 0)flushElement(copy_frame,11, 5,_cube_buffer[172]);
-  if (_cube_buffer[173] != 0)flushElement(copy_frame, 5, 2,_cube_buffer[173]);
-  if (_cube_buffer[174] != 0)flushElement(copy_frame, 2,16,_cube_buffer[174]);
-  if (_cube_buffer[175] != 0)flushElement(copy_frame,16,11,_cube_buffer[175]);
-  if (_cube_buffer[176] != 0)flushElement(copy_frame, 9, 8,_cube_buffer[176]);
-  if (_cube_buffer[177] != 0)flushElement(copy_frame, 8, 1,_cube_buffer[177]);
-  if (_cube_buffer[178] != 0)flushElement(copy_frame, 1,13,_cube_buffer[178]);
-  if (_cube_buffer[179] != 0)flushElement(copy_frame,13, 9,_cube_buffer[179]);
-  if (_cube_buffer[180] != 0)flushElement(copy_frame,10, 7,_cube_buffer[180]);
-  if (_cube_buffer[181] != 0)flushElement(copy_frame, 7, 1,_cube_buffer[181]);
-  if (_cube_buffer[182] != 0)flushElement(copy_frame, 1,16,_cube_buffer[182]);
-  if (_cube_buffer[183] != 0)flushElement(copy_frame,16,10,_cube_buffer[183]);
-  if (_cube_buffer[184] != 0)flushElement(copy_frame,11, 6,_cube_buffer[184]);
-  if (_cube_buffer[185] != 0)flushElement(copy_frame, 6, 1,_cube_buffer[185]);
-  if (_cube_buffer[186] != 0)flushElement(copy_frame, 1,14,_cube_buffer[186]);
-  if (_cube_buffer[187] != 0)flushElement(copy_frame,14,11,_cube_buffer[187]);
-  if (_cube_buffer[188] != 0)flushElement(copy_frame,12, 5,_cube_buffer[188]);
-  if (_cube_buffer[189] != 0)flushElement(copy_frame, 5, 1,_cube_buffer[189]);
-  if (_cube_buffer[190] != 0)flushElement(copy_frame, 1,15,_cube_buffer[190]);
-  if (_cube_buffer[191] != 0)flushElement(copy_frame,15,12,_cube_buffer[191]);
-
-  (_cube__frame+1)->next=copy_frame;
-  _cube_current_frame=_cube__frame+1;
+  _queued_frame * frame = &_frame_queue[_queue_head & FRAME_QUEUE_MASK];
+  frame->start = start;
+  frame->end = entry;
+  frame->pts = pts;
+  frame->lit = display_length;
+  // the frame has to be complete before the interrupt can see it
+  __asm__ __volatile__("" ::: "memory");
+  _queue_head++;
+  _logFrame(pts);
+  PROFILE_FRAME_END();
 }
 
+void flushBufferAt(unsigned long pts) {
+  if ((long)(timerMillis() - pts) > 0) frame_underruns++;
+  _queueFrame(pts);
+}
+
+void flushBuffer() {
+  _queueFrame(timerMillis());
+}
 
 
 
@@ -342,15 +544,14 @@ byte pinsD[] = {P1D,P2D,P3D,P4D,P5D,P6D,P7D,P8D,P9D,P10D,P11D,P12D,P13D,P14D,P15
 #define HALF PWMMMAX/2
 // the interrupt function to display the leds
 ISR(TIMER2_OVF_vect) {
-  int pin1 = _cube_current_frame->pin1;
-  int pin2 = _cube_current_frame->pin2;
-  int count = (pin1 & 0xF0) | ((pin2 & 0xF0)>>4);
-  pin1 = pin1&0x0F;
-  pin2 = pin2&0x0F;
+  PROFILE_DISPLAY_STEP();
+  _display_entry * entry = _display_entry_now;
+  byte pin1 = entry->pins >> 4;
+  byte pin2 = entry->pins & 0x0F;
   PORTB = 0x00;
   PORTC = 0x00;
   PORTD = 0x00;
-  if (count > pwmm){
+  if (entry->brightness > pwmm){
   
     DDRB = pinsB[pin1] | pinsB[pin2];
     DDRC = pinsC[pin1] | pinsC[pin2];
@@ -361,13 +562,60 @@ ISR(TIMER2_OVF_vect) {
     PORTD = pinsD[pin1];
     
   }
-  _cube_current_frame = _cube_current_frame->next;
-  if (_cube_current_frame == _cube__frame+1){
+  if (++entry == _pool_end) entry = _frame_entries;
+  if (entry == _display_end){
+    entry = _display_start;
     pwmm = (pwmm+1); //%PWMMMAX; 
     // oooook so the modulus function is just a tincy bit toooooo slow when only one led is on
-    if (pwmm == PWMMMAX) pwmm = 0; 
+    if (pwmm == PWMMMAX) {
+      pwmm = 0;
+      // move on to the newest queued frame that is due, only between full
+      // PWM cycles so a frame is never shown half at one brightness
+      byte tail = _queue_tail;
+      byte next = tail + 1;
+      while (next != _queue_head && (long)(_timer_ticks - _frame_queue[next & FRAME_QUEUE_MASK].pts) >= 0) {
+        next++;
+      }
+      next--;
+      if (next != tail) {
+        frames_dropped += (byte)(next - tail - 1);
+        _queued_frame * frame = &_frame_queue[next & FRAME_QUEUE_MASK];
+        entry = _display_start = frame->start;
+        _display_end = frame->end;
+        _queue_tail = next;
+        if (frame->lit == 0) {
+          PORTB = 0x00;
+          PORTC = 0x00;
+          PORTD = 0x00;
+          disableTimer2OverflowInterrupt();
+          _display_idle = true;
+        }
+        else {
+          setTimer2Prescaler(frame->lit <= DISPLAY_SLOW_LENGTH ? 8 : 1);
+        }
+      }
+    }
     // by too slow i mean "to slow for the program to process an update" here is the fix
   }
+  _display_entry_now = entry;
+}
+
+/*------------------------------ DISPLAY TICK -------------------------------*/
+/*
+ *   Called by the 1ms timer interrupt. While the display is idle on a blank
+ *   frame, this restarts it once the next frame is due. pwmm is set so the
+ *   very first step finishes the blank frame's PWM cycle and moves on, so the
+ *   new frame starts at the beginning of a cycle like any other.
+ */
+/*---------------------------------------------------------------------------*/
+void _displayTick() {
+  if (!_display_idle) return;
+  byte next = _queue_tail + 1;
+  if (next != _queue_head && (long)(_timer_ticks - _frame_queue[next & FRAME_QUEUE_MASK].pts) >= 0) {
+    _display_idle = false;
+    pwmm = PWMMMAX-1;
+    enableTimer2OverflowInterrupt();
+  }
 }
 
 /******************************************************************************\
@@ -380,15 +628,5 @@ ISR(TIMER2_OVF_vect) {
 |  16000000 / ( 256*256) = 16000000 / 65536  =   ~244 Hz                       |
 |  16000000 / (1024*256) = 16000000 / 262144 =    ~61 Hz                       |
 \******************************************************************************/
-int animationTimer = 0;
-int animationMax = 0;
-
-ISR(TIMER1_OVF_vect) {
-  animationTimer++;
-  if (animationTimer == animationMax) {
-    continuePattern = false;
-    animationTimer=0;
-  }
-}
 
 #endif
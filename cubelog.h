@@ -0,0 +1,174 @@
+/******************************************************************************\
+| CUBELOG.H                                                                    |
+|                                                                              |
+| A compact binary log of the frames that are flushed, so a show can be        |
+| looked at without the cube. Each record holds a frame's presentation time    |
+| and only the LED colors that changed since the last frame logged. With       |
+| CUBE_FRAME_LOG defined the cube writes records to the serial port whenever   |
+| it has room for them, and the host tools can write them to a file.           |
+| tools/cubeplay.cpp plays a log back in a terminal or as PPM images.          |
+\******************************************************************************/
+
+#ifndef _CUBELOG_H_
+#define _CUBELOG_H_
+
+#include <stdint.h>
+#include "cubemask.h"
+
+/*------------------------------- RECORD FORMAT -----------------------------*/
+/*
+ *   Every record is
+ *
+ *     0xC5 or 0xC6          sync byte, 0xC6 when the frame is continued in
+ *                           the next record
+ *     n                     number of changed LED colors
+ *     pts                   low 16 bits of the presentation time in ms,
+ *                           little endian
+ *     changes               n changes, two in every three bytes: the buffer
+ *                           index of the first, a byte with the level of the
+ *                           first in the low nibble and of the second in the
+ *                           high nibble, then the index of the second
+ *     sum                   the sum of every byte before it
+ *
+ *   Changes are against what the log has shown so far, starting from a dark
+ *   cube, so a frame that is left out is folded into the next one logged.
+ *   A frame with more changes than fit in one record is copied and sent
+ *   over as many records as it takes, every one but the last marked as
+ *   continued and all with the frame's own time, and newer frames are
+ *   left out until it is done. A player only shows the cube after a record
+ *   that is not continued, so it never shows half of one frame. Levels are
+ *   the buffer levels before gamma correction, clamped to 0 to
+ *   LOG_LEVEL_MAX as flushBuffer() does, not the PWM levels the display
+ *   ends up with. Frames that change nothing are not logged, a player holds
+ *   the last frame until the time of the next record. The sync byte and the
+ *   sum let a player skip over anything else that was sent on the same
+ *   serial port.
+ */
+/*---------------------------------------------------------------------------*/
+#define LOG_SYNC 0xC5
+#define LOG_SYNC_CONTINUED 0xC6
+#define LOG_HEADER 4
+#define LOG_OVERHEAD (LOG_HEADER + 1)
+#define LOG_LEVEL_MAX 15
+#define LOG_RECORD_MAX (LOG_OVERHEAD + 192 + 192/2)  // every LED color changed
+
+struct CubeLog {
+  uint8_t levels[192/2];  // the logged level of every LED color, two to a byte
+  CubeMask lit[3];        // the LED colors that are logged as lit
+  uint8_t target[192/2];  // the frame being logged, the same way
+  CubeMask targetLit[3];
+  uint16_t targetPts;
+  bool continued;         // target is only partly logged
+  uint8_t resume;         // buffer index the next record starts looking from
+};
+
+void resetLog(CubeLog & log) {
+  for (uint8_t i = 0; i < 192/2; i++) log.levels[i] = 0;
+  log.lit[0] = log.lit[1] = log.lit[2] = MASK_EMPTY;
+  log.continued = false;
+  log.resume = 0;
+}
+
+inline uint8_t _nibble(const uint8_t * levels, uint8_t index) {
+  return (levels[index >> 1] >> ((index & 1) * 4)) & 0x0F;
+}
+
+inline void _setNibble(uint8_t * levels, uint8_t index, uint8_t level) {
+  uint8_t shift = (index & 1) * 4;
+  levels[index >> 1] = (levels[index >> 1] & ~(0x0F << shift)) | (level << shift);
+}
+
+inline uint8_t loggedLevel(const CubeLog & log, uint8_t index) {
+  return _nibble(log.levels, index);
+}
+
+/* Copies the lit LED colors of buffer into the log's target, clamped like flushBuffer() does. */
+void _takeFrame(CubeLog & log, unsigned long pts, const char * buffer, const CubeMask * mask) {
+  for (uint8_t i = 0; i < 192/2; i++) log.target[i] = 0;
+  for (uint8_t plane = 0; plane < 3; plane++) {
+    CubeMask look = mask[plane];
+    log.targetLit[plane] = MASK_EMPTY;
+    while (look) {
+      uint8_t bit = maskNext(look);
+      uint8_t index = plane*64 + bit;
+      uint8_t level = buffer[index];
+      if (level == 0) continue;
+      if (level > LOG_LEVEL_MAX) level = LOG_LEVEL_MAX;
+      _setNibble(log.target, index, level);
+      maskSet(log.targetLit[plane], bit);
+    }
+  }
+  log.targetPts = pts;
+}
+
+/*------------------------------- ENCODE FRAME ------------------------------*/
+/*
+ *   Writes the record for buffer into record, using at most room bytes, and
+ *   returns its length, or 0 when nothing changed or not even one change
+ *   fits. Only the LED colors set in mask (the buffer's lit masks, see
+ *   cubemask.h) or lit in the log are looked at, so the cost follows the
+ *   number of lit LEDs and is at most one step per LED color. When room
+ *   runs out the record is marked continued and the next calls carry on
+ *   with the rest of the same frame, from where this one stopped, whatever
+ *   buffer they are given.
+ */
+/*---------------------------------------------------------------------------*/
+unsigned int encodeFrame(CubeLog & log, unsigned long pts, const char * buffer,
+                         const CubeMask * mask, uint8_t * record, unsigned int room) {
+  if (room > LOG_RECORD_MAX) room = LOG_RECORD_MAX;
+  if (room < LOG_OVERHEAD + 2) return 0;
+  room -= 1;  // keep the sum byte
+  if (!log.continued) _takeFrame(log, pts, buffer, mask);
+
+  uint8_t start = log.resume;
+  uint8_t startPlane = start >> 6;
+  CubeMask below = maskIndex(start) - 1;  // the start plane's LEDs before start
+  unsigned int length = LOG_HEADER;
+  uint8_t count = 0;
+  bool full = false;
+
+  /* the start plane from start on, the other two planes, then the start plane up to start */
+  for (uint8_t step = 0; step < 4 && !full; step++) {
+    uint8_t plane = (startPlane + step) % 3;
+    CubeMask look = log.targetLit[plane] | log.lit[plane];
+    if (step == 0) look &= ~below;
+    if (step == 3) look &= below;
+    while (look && !full) {
+      uint8_t index = plane*64 + maskNext(look);
+      uint8_t level = _nibble(log.target, index);
+      if (level == loggedLevel(log, index)) continue;
+
+      if (length + ((count & 1) ? 1 : 2) > room) {
+        log.resume = index;
+        full = true;
+        break;
+      }
+      if ((count & 1) == 0) {
+        record[length++] = index;
+        record[length++] = level;
+      }
+      else {
+        record[length-1] |= level << 4;
+        record[length++] = index;
+      }
+      count++;
+
+      _setNibble(log.levels, index, level);
+      if (level) log.lit[plane] |= maskIndex(index);
+      else log.lit[plane] &= ~maskIndex(index);
+    }
+  }
+  log.continued = full;
+  if (count == 0) return 0;
+
+  record[0] = full ? LOG_SYNC_CONTINUED : LOG_SYNC;
+  record[1] = count;
+  record[2] = log.targetPts & 0xFF;
+  record[3] = (log.targetPts >> 8) & 0xFF;
+  uint8_t sum = 0;
+  for (unsigned int i = 0; i < length; i++) sum += record[i];
+  record[length++] = sum;
+  return length;
+}
+
+#endif
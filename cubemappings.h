@@ -82,4 +82,41 @@
 #define P16C 0x08
 #define P16D 0x00
 
+/*------------------------------- LED PIN PAIRS -----------------------------*/
+/*
+ *   The two column pins that light each LED color in _cube_buffer, in buffer
+ *   order. The high nibble is the pin driven high and the low nibble the pin
+ *   pulled low, numbered from 0, so 0x37 is P4 high and P8 low.
+ */
+/*---------------------------------------------------------------------------*/
+const byte cube_pins[192] PROGMEM = {
+  // red
+  0x37,0xF3,0xBF,0x7B,0x36,0xC3,0xAC,0x6A,
+  0x35,0xE3,0x9E,0x59,0x34,0xD3,0x8D,0x48,
+  0x27,0xE2,0xAE,0x7A,0x26,0xD2,0xBD,0x6B,
+  0x25,0xF2,0x8F,0x58,0x24,0xC2,0x9C,0x49,
+  0x17,0xD1,0x9D,0x79,0x16,0xE1,0x8E,0x68,
+  0x15,0xC1,0xBC,0x5B,0x14,0xF1,0xAF,0x4A,
+  0x07,0xC0,0x8C,0x78,0x06,0xF0,0x9F,0x69,
+  0x05,0xD0,0xAD,0x5A,0x04,0xE0,0xBE,0x4B,
+  // green
+  0xF7,0xB3,0x7F,0x3B,0xC6,0xA3,0x6C,0x3A,
+  0xE5,0x93,0x5E,0x39,0xD4,0x83,0x4D,0x38,
+  0xE7,0xA2,0x7E,0x2A,0xD6,0xB2,0x6D,0x2B,
+  0xF5,0x82,0x5F,0x28,0xC4,0x92,0x4C,0x29,
+  0xD7,0x91,0x7D,0x19,0xE6,0x81,0x6E,0x18,
+  0xC5,0xB1,0x5C,0x1B,0xF4,0xA1,0x4F,0x1A,
+  0xC7,0x80,0x7C,0x08,0xF6,0x90,0x6F,0x09,
+  0xD5,0xA0,0x5D,0x0A,0xE4,0xB0,0x4E,0x0B,
+  // blue
+  0xB7,0x73,0x3F,0xFB,0xA6,0x63,0x3C,0xCA,
+  0x95,0x53,0x3E,0xE9,0x84,0x43,0x3D,0xD8,
+  0xA7,0x72,0x2E,0xEA,0xB6,0x62,0x2D,0xDB,
+  0x85,0x52,0x2F,0xF8,0x94,0x42,0x2C,0xC9,
+  0x97,0x71,0x1D,0xD9,0x86,0x61,0x1E,0xE8,
+  0xB5,0x51,0x1C,0xCB,0xA4,0x41,0x1F,0xFA,
+  0x87,0x70,0x0C,0xC8,0x96,0x60,0x0F,0xF9,
+  0xA5,0x50,0x0D,0xDA,0xB4,0x40,0x0E,0xEB
+};
+
 #endif
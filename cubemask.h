@@ -0,0 +1,180 @@
+/******************************************************************************\
+| CUBEMASK.H                                                                   |
+|                                                                              |
+| Occupancy masks for the cube. One color plane holds 64 LEDs, so which of     |
+| them are lit fits in one 64 bit CubeMask, with bit x*16+y*4+z standing for   |
+| the LED at x,y,z just like its place in the plane. Moving, combining and     |
+| testing shapes is then a few shifts and ands instead of loops over the       |
+| buffer, and flushBuffer() only has to visit the LEDs whose bit is set.       |
+\******************************************************************************/
+
+#ifndef _CUBEMASK_H_
+#define _CUBEMASK_H_
+
+#include <stdint.h>
+
+#ifdef ARDUINO
+#include <avr/pgmspace.h>
+#endif
+
+typedef uint64_t CubeMask;
+
+#define MASK_EMPTY ((CubeMask)0)
+#define MASK_FULL  (~(CubeMask)0)
+
+/* Steps between neighbouring LEDs along each axis, in bits. */
+#define AXIS_X 16
+#define AXIS_Y 4
+#define AXIS_Z 1
+
+/*--------------------------------- MASK LED --------------------------------*/
+/*
+ *   The mask of the single LED at x,y,z, or of the LED at a plane index.
+ */
+/*---------------------------------------------------------------------------*/
+inline CubeMask maskIndex(uint8_t index) {
+  return (CubeMask)1 << (index & 63);
+}
+
+inline CubeMask maskLed(uint8_t x, uint8_t y, uint8_t z) {
+  return maskIndex(x*16 + y*4 + z);
+}
+
+/*-------------------------------- MASK LAYER -------------------------------*/
+/*
+ *   Every LED whose coordinate along axis is index, so maskLayer(AXIS_Z, 0)
+ *   is the bottom layer. And with it to pull one layer out of a mask.
+ */
+/*---------------------------------------------------------------------------*/
+CubeMask maskLayer(uint8_t axis, uint8_t index) {
+  CubeMask first;
+  if (axis == AXIS_X)      first = 0x000000000000FFFFULL;
+  else if (axis == AXIS_Y) first = 0x000F000F000F000FULL;
+  else                     first = 0x1111111111111111ULL;
+  return first << (axis * (index & 3));
+}
+
+inline CubeMask maskExtractLayer(CubeMask mask, uint8_t axis, uint8_t index) {
+  return mask & maskLayer(axis, index);
+}
+
+/*-------------------------------- MASK SHIFT -------------------------------*/
+/*
+ *   Moves every LED of mask steps along axis, towards higher coordinates
+ *   for a positive steps. LEDs that move off the edge of the cube are
+ *   dropped instead of wrapping around into the next row.
+ */
+/*---------------------------------------------------------------------------*/
+CubeMask maskShift(CubeMask mask, uint8_t axis, int8_t steps) {
+  if (steps >= 4 || steps <= -4) return MASK_EMPTY;
+  for (; steps > 0; steps--) mask = (mask & ~maskLayer(axis, 3)) << axis;
+  for (; steps < 0; steps++) mask = (mask & ~maskLayer(axis, 0)) >> axis;
+  return mask;
+}
+
+/*------------------------------ MASK OPERATIONS ----------------------------*/
+/*
+ *   Set operations on masks. maskCollides() is true when the two masks
+ *   share at least one LED, which is the whole collision test for a snake
+ *   running into itself or a block landing on the stack.
+ */
+/*---------------------------------------------------------------------------*/
+inline CubeMask maskUnion(CubeMask one, CubeMask two)     { return one | two; }
+inline CubeMask maskIntersect(CubeMask one, CubeMask two) { return one & two; }
+inline CubeMask maskRemove(CubeMask mask, CubeMask gone)  { return mask & ~gone; }
+inline bool maskCollides(CubeMask one, CubeMask two)      { return (one & two) != 0; }
+inline bool maskHas(CubeMask mask, uint8_t index)         { return (mask & maskIndex(index)) != 0; }
+
+/*------------------------------ MASK ITERATION -----------------------------*/
+/*
+ *   mask_low_bit[b] is the number of the lowest set bit of the byte b.
+ *   The AVR has no instruction that finds a set bit, and a 64 bit count
+ *   trailing zeros is a library loop, so masks are walked one byte at a
+ *   time: empty bytes are skipped whole and the table finds the bits in
+ *   the rest. On the host the compiler's own count trailing zeros is used.
+ *
+ *   maskNext() returns the index of the lowest LED in mask and removes it,
+ *   so "while (mask) { index = maskNext(mask); ... }" visits every lit LED
+ *   and nothing else. mask must not be empty.
+ */
+/*---------------------------------------------------------------------------*/
+const uint8_t mask_low_bit[256] PROGMEM = {
+  0,0,1,0,2,0,1,0,3,0,1,0,2,0,1,0,
+  4,0,1,0,2,0,1,0,3,0,1,0,2,0,1,0,
+  5,0,1,0,2,0,1,0,3,0,1,0,2,0,1,0,
+  4,0,1,0,2,0,1,0,3,0,1,0,2,0,1,0,
+  6,0,1,0,2,0,1,0,3,0,1,0,2,0,1,0,
+  4,0,1,0,2,0,1,0,3,0,1,0,2,0,1,0,
+  5,0,1,0,2,0,1,0,3,0,1,0,2,0,1,0,
+  4,0,1,0,2,0,1,0,3,0,1,0,2,0,1,0,
+  7,0,1,0,2,0,1,0,3,0,1,0,2,0,1,0,
+  4,0,1,0,2,0,1,0,3,0,1,0,2,0,1,0,
+  5,0,1,0,2,0,1,0,3,0,1,0,2,0,1,0,
+  4,0,1,0,2,0,1,0,3,0,1,0,2,0,1,0,
+  6,0,1,0,2,0,1,0,3,0,1,0,2,0,1,0,
+  4,0,1,0,2,0,1,0,3,0,1,0,2,0,1,0,
+  5,0,1,0,2,0,1,0,3,0,1,0,2,0,1,0,
+  4,0,1,0,2,0,1,0,3,0,1,0,2,0,1,0,
+};
+
+uint8_t maskNext(CubeMask & mask) {
+#ifdef ARDUINO
+  uint8_t * bytes = (uint8_t *)&mask;   // the AVR is little endian, bytes[0] is LEDs 0 to 7
+  uint8_t base = 0;
+  while (*bytes == 0) { bytes++; base += 8; }
+  uint8_t bits = *bytes;
+  *bytes = bits & (bits - 1);
+  return base + pgm_read_byte(&mask_low_bit[bits]);
+#else
+  uint8_t index = __builtin_ctzll(mask);
+  mask &= mask - 1;
+  return index;
+#endif
+}
+
+/*--------------------------------- MASK SET --------------------------------*/
+/*
+ *   Sets the bit of one LED in mask. maskIndex() shifts a 64 bit 1 by a
+ *   variable count, which the AVR can only do with a library call, and
+ *   the or that follows takes eight more registers. Instead the byte that
+ *   holds the LED is found from index / 8 and its bit from a table of 8,
+ *   so marking an LED is a load, an or and a store. The host is little
+ *   endian as well, so the same code is used there.
+ */
+/*---------------------------------------------------------------------------*/
+const uint8_t mask_bit[8] = {0x01,0x02,0x04,0x08,0x10,0x20,0x40,0x80};
+
+inline void maskSet(CubeMask & mask, uint8_t index) {
+  ((uint8_t *)&mask)[(index >> 3) & 7] |= mask_bit[index & 7];
+}
+
+/*-------------------------------- MASK COUNT -------------------------------*/
+/*
+ *   The number of LEDs in mask, clearing one set bit per step.
+ */
+/*---------------------------------------------------------------------------*/
+uint8_t maskCount(CubeMask mask) {
+  const uint8_t * bytes = (const uint8_t *)&mask;
+  uint8_t count = 0;
+  for (uint8_t i = 0; i < 8; i++) {
+    for (uint8_t bits = bytes[i]; bits; bits &= bits - 1) count++;
+  }
+  return count;
+}
+
+/*----------------------------- MASK FROM BUFFER ----------------------------*/
+/*
+ *   Builds the mask of the lit LEDs in one color plane of a buffer, for
+ *   code that has written the buffer without keeping its mask up to date.
+ */
+/*---------------------------------------------------------------------------*/
+CubeMask maskFromBuffer(const char * buffer, uint8_t plane) {
+  CubeMask mask = MASK_EMPTY;
+  const char * level = buffer + plane*64;
+  for (uint8_t i = 0; i < 64; i++) {
+    if (level[i] != 0) mask |= maskIndex(i);
+  }
+  return mask;
+}
+
+#endif
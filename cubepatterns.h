@@ -0,0 +1,368 @@
+/******************************************************************************\
+| CUBEPATTERNS.H                                                               |
+|                                                                              |
+| The light patterns written as pure functions of time. A pattern's render     |
+| function draws the frame that belongs at t milliseconds into a buffer, and   |
+| given the same t and seed it always draws the same frame. That lets the      |
+| show skip frames when it falls behind, jump straight to any point, and be    |
+| rendered on a PC (see tools/cubebake.cpp) exactly as the cube shows it.      |
+| playShow() at the bottom plays the show into the display queue on the cube.  |
+\******************************************************************************/
+
+#ifndef _CUBEPATTERNS_H_
+#define _CUBEPATTERNS_H_
+
+#include <stdint.h>
+#include "cuberandom.h"
+#include "cubemask.h"
+
+#ifdef ARDUINO
+#include "cubehelper.h"
+#endif
+
+/* PatternRender draws one frame into a buffer that has been cleared first. */
+typedef void (*PatternRender)(unsigned long t, uint32_t seed, char * buffer);
+
+struct CubePattern {
+  const char * name;
+  PatternRender render;
+  unsigned int duration;  // a whole number of the pattern's cycles
+};
+
+/*---------------------------------------------------------------------------*\
+|*------------------------------ FRAME DRAWING ------------------------------*|
+\*---------------------------------------------------------------------------*/
+
+/*-------------------------------- FRAME LED --------------------------------*/
+/*
+ *   The same as drawLed(), but draws into the buffer it is given instead of
+ *   _cube_buffer.
+ */
+/*---------------------------------------------------------------------------*/
+void frameLed(char * buffer, int color, int brightness, int x, int y, int z) {
+  int led = (x*16)+(y*4)+z;
+  if (color < 0) {
+    buffer[led] = 0;
+    buffer[led+64] = 0;
+    buffer[led+128] = 0;
+    return;
+  }
+  if (color > 6) return;
+  byte planes = _color_planes[color];
+  if (planes & 0x01) { buffer[led]     += brightness; markLit(buffer, led); }
+  if (planes & 0x02) { buffer[led+64]  += brightness; markLit(buffer, led+64); }
+  if (planes & 0x04) { buffer[led+128] += brightness; markLit(buffer, led+128); }
+}
+
+/*-------------------------------- FRAME MASK -------------------------------*/
+/*
+ *   Draws every LED of a CubeMask in one color, so a shape that is kept as
+ *   a mask (a snake, a falling block) costs one step per LED it lights.
+ */
+/*---------------------------------------------------------------------------*/
+void frameMask(char * buffer, int color, int brightness, CubeMask mask) {
+  while (mask) {
+    byte led = maskNext(mask);
+    frameLed(buffer, color, brightness, led >> 4, (led >> 2) & 3, led & 3);
+  }
+}
+
+/*-------------------------------- FRAME ROW --------------------------------*/
+/*
+ *   Fills layer z of the buffer, like drawRow().
+ */
+/*---------------------------------------------------------------------------*/
+void frameRow(char * buffer, int color, int brightness, int z) {
+  for (int x = 0; x <= 3; x++) {
+    for (int y = 0; y <= 3; y++) {
+      frameLed(buffer, color, brightness, x, y, z);
+    }
+  }
+}
+
+/*-------------------------------- FRAME CUBE -------------------------------*/
+/*
+ *   Fills every LED of the buffer, like drawBox() over the whole cube.
+ */
+/*---------------------------------------------------------------------------*/
+void frameCube(char * buffer, int color, int brightness) {
+  for (int z = 0; z <= 3; z++) {
+    frameRow(buffer, color, brightness, z);
+  }
+}
+
+/*----------------------------- FRAME BOX WALLS -----------------------------*/
+/*
+ *   The same as drawBoxWalls(), which draws the corners twice. The start
+ *   coordinates must not be larger than the end coordinates.
+ */
+/*---------------------------------------------------------------------------*/
+void frameBoxWalls(char * buffer, int color, int brightness, int startx, int starty,
+                   int startz, int endx, int endy, int endz) {
+  for (int i = startz; i <= endz; i++) {
+    for (int j = starty; j <= endy; j++) {
+      frameLed(buffer, color, brightness, startx, j, i);
+      frameLed(buffer, color, brightness, endx, j, i);
+    }
+    for (int j = startx; j <= endx; j++) {
+      frameLed(buffer, color, brightness, j, starty, i);
+      frameLed(buffer, color, brightness, j, endy, i);
+    }
+  }
+}
+
+/*------------------------------- CYCLE RANDOM ------------------------------*/
+/*
+ *   Starts a random stream for one cycle of a pattern. Seeding by cycle
+ *   number instead of carrying a stream along from frame to frame is what
+ *   lets a pattern start at any time.
+ */
+/*---------------------------------------------------------------------------*/
+CubeRandom cycleRandom(uint32_t seed, unsigned long cycle) {
+  CubeRandom stream;
+  seedRandom(stream, seed, cycle);
+  return stream;
+}
+
+/*---------------------------------------------------------------------------*\
+|*--------------------------------- PATTERNS --------------------------------*|
+\*---------------------------------------------------------------------------*/
+
+/*----------------------------------- BOX FADE ------------------------------*/
+/*
+ *   The whole cube fades in over 15 steps of 30ms, holds for 600ms, and fades
+ *   back out, in a new random color every 1500ms cycle.
+ */
+/*---------------------------------------------------------------------------*/
+#define BOX_FADE_CYCLE 1500
+void renderBoxFade(unsigned long t, uint32_t seed, char * buffer) {
+  CubeRandom stream = cycleRandom(seed, t / BOX_FADE_CYCLE);
+  int color = randomRange(stream, 0, 6);
+  unsigned int phase = t % BOX_FADE_CYCLE;
+  int brightness;
+  if (phase < 450)       brightness = phase/30 + 1;
+  else if (phase < 1050) brightness = 15;
+  else                   brightness = 14 - (phase-1050)/30;
+  frameCube(buffer, color, brightness);
+}
+
+/*--------------------------------- MOVING DOTS -----------------------------*/
+/*
+ *   One LED on the diagonal fades in over 15 steps of 20ms, holds for 200ms
+ *   and fades out. Each 800ms cycle picks a new position and color.
+ */
+/*---------------------------------------------------------------------------*/
+#define MOVING_DOTS_CYCLE 800
+void renderMovingDots(unsigned long t, uint32_t seed, char * buffer) {
+  CubeRandom stream = cycleRandom(seed, t / MOVING_DOTS_CYCLE);
+  int pos = randomRange(stream, 0, 3);
+  int color = randomRange(stream, 0, 6);
+  unsigned int phase = t % MOVING_DOTS_CYCLE;
+  int brightness;
+  if (phase < 300)      brightness = phase/20 + 1;
+  else if (phase < 500) brightness = 15;
+  else                  brightness = 14 - (phase-500)/20;
+  frameLed(buffer, color, brightness, pos, pos, pos);
+}
+
+/*------------------------------- FALLING ROWS ------------------------------*/
+/*
+ *   Each layer fades in over 13 steps of 10ms, holds for 100ms, then fades
+ *   out from full over 10 steps while the layer below starts to fade in.
+ *   The fade out goes down by 2 and then by 1, like the VM version in
+ *   tools/examples/fallingrows.cas. A cycle is
+ *   four layers (1320ms) in one random color, and the color also picks the
+ *   starting layer.
+ */
+/*---------------------------------------------------------------------------*/
+#define FALLING_ROW_TIME 330
+#define FALLING_ROWS_CYCLE (4*FALLING_ROW_TIME)
+void renderFallingRows(unsigned long t, uint32_t seed, char * buffer) {
+  CubeRandom stream = cycleRandom(seed, t / FALLING_ROWS_CYCLE);
+  int color = randomRange(stream, 0, 3);
+  unsigned int phase = t % FALLING_ROWS_CYCLE;
+  int level = (color + phase / FALLING_ROW_TIME) % 4;
+  int z = 3 - level;
+  phase %= FALLING_ROW_TIME;
+
+  if (phase < 130) {
+    frameRow(buffer, color, 3 + phase/10, z);
+  }
+  else if (phase < 230) {
+    frameRow(buffer, color, 15, z);
+  }
+  else {
+    int i = (phase-230)/10;
+    frameRow(buffer, color, i < 6 ? 15 - 2*i : 9 - i, z);
+    if (i >= 6 && z > 0) {
+      frameRow(buffer, color, i-6, z-1);
+    }
+  }
+}
+
+/*------------------------------- TUNNEL WARP -------------------------------*/
+/*
+ *   Eight rings of box walls, four inner and four outer, each drawn in a red
+ *   and a blue shade that step along to the next ring every 100ms. Nothing
+ *   in it is random, so it looks the same for every seed.
+ */
+/*---------------------------------------------------------------------------*/
+#define TUNNEL_WARP_FRAME 100
+const char tunnel_color1[]  = {0,0,0,0,2,2,2,2};
+const char tunnel_bright1[] = {4,8,11,15,4,8,11,15};
+const char tunnel_color2[]  = {2,2,2,2,0,0,0,0};
+const char tunnel_bright2[] = {15,11,8,4,15,11,8,4};
+
+void renderTunnelWarp(unsigned long t, uint32_t /*seed*/, char * buffer) {
+  unsigned long frame = t / TUNNEL_WARP_FRAME;
+  for (int ring = 0; ring < 8; ring++) {
+    int index = (ring + frame) % 8;
+    int start = (ring < 4) ? 1 : 0;
+    int end   = (ring < 4) ? 2 : 3;
+    int z     = (ring < 4) ? ring : 7-ring;
+    frameBoxWalls(buffer, tunnel_color1[index], tunnel_bright1[index], start, start, z, end, end, z);
+    frameBoxWalls(buffer, tunnel_color2[index], tunnel_bright2[index], start, start, z, end, end, z);
+  }
+}
+
+/*---------------------------------------------------------------------------*\
+|*----------------------------------- SHOW ----------------------------------*|
+\*---------------------------------------------------------------------------*/
+
+/* The show plays these patterns in order and then starts over. */
+const CubePattern cube_show[] = {
+  {"boxFade",     renderBoxFade,     4*BOX_FADE_CYCLE},
+  {"movingDots",  renderMovingDots,  7*MOVING_DOTS_CYCLE},
+  {"fallingRows", renderFallingRows, 4*FALLING_ROWS_CYCLE},
+  {"tunnelWarp",  renderTunnelWarp,  50*TUNNEL_WARP_FRAME},
+};
+#define SHOW_PATTERNS (sizeof(cube_show)/sizeof(cube_show[0]))
+
+/*-------------------------------- SHOW LENGTH ------------------------------*/
+/*
+ *   How long one pass through every pattern in the show takes.
+ */
+/*---------------------------------------------------------------------------*/
+unsigned long showLength() {
+  unsigned long length = 0;
+  for (unsigned int i = 0; i < SHOW_PATTERNS; i++) {
+    length += cube_show[i].duration;
+  }
+  return length;
+}
+
+/*------------------------------- SHOW PATTERN ------------------------------*/
+/*
+ *   Finds which pattern is playing t milliseconds into the show. The time
+ *   into that pattern is stored in patternTime, and a seed for this pass of
+ *   the pattern in patternSeed, so every pass looks different but every pass
+ *   can be drawn again from just the show seed.
+ */
+/*---------------------------------------------------------------------------*/
+const CubePattern * showPattern(unsigned long t, uint32_t seed,
+                                unsigned long & patternTime, uint32_t & patternSeed) {
+  unsigned long length = showLength();
+  unsigned long pass = t / length;
+  patternTime = t % length;
+  unsigned int i = 0;
+  while (patternTime >= cube_show[i].duration) {
+    patternTime -= cube_show[i].duration;
+    i++;
+  }
+  CubeRandom stream;
+  seedRandom(stream, seed, pass*SHOW_PATTERNS + i);
+  patternSeed = nextRandom(stream);
+  return &cube_show[i];
+}
+
+/*-------------------------------- RENDER SHOW ------------------------------*/
+/*
+ *   Clears buffer and draws the frame that belongs t milliseconds into the
+ *   show. Returns the pattern that drew it.
+ */
+/*---------------------------------------------------------------------------*/
+const CubePattern * renderShow(unsigned long t, uint32_t seed, char * buffer) {
+  unsigned long patternTime;
+  uint32_t patternSeed;
+  const CubePattern * pattern = showPattern(t, seed, patternTime, patternSeed);
+  for (int i = 0; i < BUFFERSIZE; i++) {
+    buffer[i] = 0;
+  }
+  clearLit(buffer);
+  pattern->render(patternTime, patternSeed, buffer);
+  return pattern;
+}
+
+/*---------------------------------------------------------------------------*\
+|*---------------------------------- PLAYER ---------------------------------*|
+\*---------------------------------------------------------------------------*/
+#ifdef ARDUINO
+
+/*-------------------------------- PLAY SHOW --------------------------------*/
+/*
+ *   Plays duration milliseconds of the show on the cube, carrying on from
+ *   where the last call stopped. Frames are rendered ahead of time into the
+ *   display queue, each stamped with the time it should appear, for as long
+ *   as the queue has a slot and the pool has room for a frame as big as the
+ *   last one. Otherwise the loop sleeps in delay(), so flushBuffer() rarely
+ *   has to wait.
+ *   When drawing falls behind, the frames that were missed are skipped
+ *   instead of slowing the pattern down, and seekShow() can jump to any
+ *   point of the show.
+ *
+ *   Building with CUBE_PROFILE prints the frame cost, queue and sleep
+ *   statistics of each pattern as it ends and how many frames were skipped.
+ */
+/*---------------------------------------------------------------------------*/
+#define SHOW_FRAME_TIME 10
+
+unsigned long showTime = 0;
+unsigned long framesSkipped = 0;
+
+void seekShow(unsigned long t) {
+  showTime = t;
+}
+
+#ifdef CUBE_PROFILE
+void printSkippedFrames() {
+  Serial.print(F("show: "));
+  Serial.print(framesSkipped);
+  Serial.println(F(" frames skipped"));
+}
+#else
+void printSkippedFrames() {}
+#endif
+
+void playShow(unsigned long duration, uint32_t seed) {
+  unsigned long startTicks = timerMillis();
+  unsigned long startTime = showTime;
+  unsigned long frame = 0;
+  const CubePattern * playing = 0;
+  startPatternTimer(duration);
+
+  while (continuePattern) {
+    if (!frameQueueRoom(display_length) || frame*SHOW_FRAME_TIME >= duration) {
+      delay(1);
+      continue;
+    }
+    unsigned long due = (timerMillis() - startTicks) / SHOW_FRAME_TIME;
+    if (frame < due) {
+      framesSkipped += due - frame;
+      frame = due;
+    }
+
+    clearBuffer();
+    const CubePattern * pattern = renderShow(startTime + frame*SHOW_FRAME_TIME, seed, _cube_buffer);
+    flushBufferAt(startTicks + frame*SHOW_FRAME_TIME);
+    if (playing && pattern != playing) printFrameProfile(playing->name);
+    playing = pattern;
+    frame++;
+  }
+  showTime = startTime + duration;
+  if (playing) printFrameProfile(playing->name);
+  printSkippedFrames();
+}
+
+#endif
+
+#endif
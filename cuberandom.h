@@ -0,0 +1,87 @@
+/******************************************************************************\
+| CUBERANDOM.H                                                                 |
+|                                                                              |
+| A small xorshift random number generator for the patterns. It replaces the   |
+| Arduino random(min,max), which costs a 32 bit division for every call and    |
+| cannot be replayed. Each pattern gets its own stream, and the same seed      |
+| gives the same numbers on the cube and in the host tools, since this file    |
+| only uses plain integer math.                                                |
+\******************************************************************************/
+
+#ifndef _CUBERANDOM_H_
+#define _CUBERANDOM_H_
+
+#include <stdint.h>
+
+/* CubeRandom is one independent stream of random numbers. */
+struct CubeRandom {
+  uint32_t state;
+};
+
+/*-------------------------------- SEED RANDOM ------------------------------*/
+/*
+ *   Starts a stream from a seed and a stream number. Different stream
+ *   numbers with the same seed give unrelated sequences, so every pattern
+ *   can have its own stream that does not shift when another pattern draws
+ *   more or fewer numbers.
+ */
+/*---------------------------------------------------------------------------*/
+void seedRandom(CubeRandom & stream, uint32_t seed, uint16_t streamId) {
+  uint32_t x = seed ^ ((uint32_t)streamId * 0x9E3779B9UL);
+  x ^= x >> 16;
+  x *= 0x7FEB352DUL;
+  x ^= x >> 15;
+  x *= 0x846CA68BUL;
+  x ^= x >> 16;
+  stream.state = x ? x : 0x6D2B79F5UL; // xorshift must never be all zeros
+}
+
+/*-------------------------------- NEXT RANDOM ------------------------------*/
+/*
+ *   Marsaglia's 32 bit xorshift (13, 17, 5). Only shifts and xors, which
+ *   the AVR does in a few dozen cycles.
+ */
+/*---------------------------------------------------------------------------*/
+inline uint32_t nextRandom(CubeRandom & stream) {
+  uint32_t x = stream.state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  stream.state = x;
+  return x;
+}
+
+/*------------------------------- RANDOM BELOW ------------------------------*/
+/*
+ *   Returns a number from 0 to range-1 with no bias, using Lemire's
+ *   multiply and shift instead of a modulo. The slow path with a modulo
+ *   only runs when the low half of the product lands below range, which
+ *   for the small ranges the patterns use is about once in a few thousand
+ *   calls.
+ */
+/*---------------------------------------------------------------------------*/
+inline uint16_t randomBelow(CubeRandom & stream, uint16_t range) {
+  uint32_t product = (uint32_t)(uint16_t)(nextRandom(stream) >> 16) * range;
+  uint16_t low = (uint16_t)product;
+  if (low < range) {
+    uint16_t threshold = (uint16_t)(0 - range) % range;
+    while (low < threshold) {
+      product = (uint32_t)(uint16_t)(nextRandom(stream) >> 16) * range;
+      low = (uint16_t)product;
+    }
+  }
+  return product >> 16;
+}
+
+/*------------------------------- RANDOM RANGE ------------------------------*/
+/*
+ *   Drop in for random(howsmall, howbig): a number from howsmall to
+ *   howbig-1, or howsmall when the range is empty.
+ */
+/*---------------------------------------------------------------------------*/
+inline int randomRange(CubeRandom & stream, int howsmall, int howbig) {
+  if (howsmall >= howbig) return howsmall;
+  return howsmall + randomBelow(stream, howbig - howsmall);
+}
+
+#endif
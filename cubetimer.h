@@ -0,0 +1,240 @@
+/******************************************************************************\
+| CUBETIMER.H                                                                  |
+|                                                                              |
+| Software timers on a 1ms Timer1 tick. Any number of one shot or periodic     |
+| callbacks (up to TIMER_COUNT) are kept in a hashed timer wheel, so starting, |
+| cancelling and expiring a timer takes the same time no matter how many are   |
+| running. The interrupt only counts ticks and raises a flag; the callbacks    |
+| are run from serviceTimers() in the main loop, which delay() calls for us    |
+| through yield().                                                             |
+\******************************************************************************/
+
+#ifndef _CUBETIMER_H_
+#define _CUBETIMER_H_
+
+#include "Arduino.h"
+#include "niceTimer.h"
+
+#define TIMER_WHEEL_SLOTS 32   // must be a power of two
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SLOTS-1)
+#define TIMER_COUNT 16
+#define TIMER_NONE 0xFF
+#define TIMER_EXPIRED 0xFE
+
+typedef void (*TimerCallback)();
+
+/* _soft_timer is one entry in the wheel, linked to the others in its slot. */
+struct _soft_timer {
+  TimerCallback callback;
+  unsigned int period;   // 0 for a one shot timer
+  unsigned int rounds;   // full turns of the wheel left before it expires
+  byte slot;             // TIMER_NONE while the timer is free, TIMER_EXPIRED
+                         // while a one shot waits for its callback to run
+  bool due;              // expired, and its callback has not run yet
+  byte next;
+  byte prev;
+};
+
+_soft_timer _timers[TIMER_COUNT];
+byte _timer_wheel[TIMER_WHEEL_SLOTS];
+byte _timer_free;
+
+/* _timer_ticks is counted by the interrupt, _timer_serviced by serviceTimers(). */
+volatile unsigned long _timer_ticks = 0;
+volatile bool _timer_pending = false;
+unsigned long _timer_serviced = 0;
+bool _timer_servicing = false;
+
+/*-------------------------------- INIT TIMERS ------------------------------*/
+/*
+ *   Empties the wheel and sets Timer1 to interrupt once every millisecond:
+ *   16MHz / 64 / 250 = 1000Hz.
+ */
+/*---------------------------------------------------------------------------*/
+void initTimers() {
+  for (byte i = 0; i < TIMER_WHEEL_SLOTS; i++) {
+    _timer_wheel[i] = TIMER_NONE;
+  }
+  for (byte i = 0; i < TIMER_COUNT; i++) {
+    _timers[i].slot = TIMER_NONE;
+    _timers[i].next = (i+1 < TIMER_COUNT) ? i+1 : TIMER_NONE;
+  }
+  _timer_free = 0;
+
+  setTimer1Prescaler(64);
+  setTimer1Mode(TIMER1_CTC);
+  setTimer1OutputCompareA(249);
+  enableTimer1CompareAInterrupt();
+}
+
+/*-------------------------------- TIMER MILLIS -----------------------------*/
+/*
+ *   The number of 1ms ticks since initTimers(). This is the timebase that
+ *   patterns, the display queue and statistics all share.
+ */
+/*---------------------------------------------------------------------------*/
+unsigned long timerMillis() {
+  byte oldSREG = SREG;
+  cli();
+  unsigned long ticks = _timer_ticks;
+  SREG = oldSREG;
+  return ticks;
+}
+
+/*----------------------------- TIMER WHEEL LINKS ---------------------------*/
+/*
+ *   Puts a timer into the slot it expires in, or takes it back out again.
+ *   A timer started from a callback, and a periodic timer going round
+ *   again, counts delay from the tick being serviced, so periodic timers
+ *   keep their phase. Any other timer counts from now. The wheel is only
+ *   serviced while it has timers in it, so the last serviced tick can be
+ *   behind now: if no slot has been flagged since, every tick in between
+ *   found an empty slot and the wheel is moved up to now, otherwise rounds
+ *   counts the turns from the last serviced tick.
+ */
+/*---------------------------------------------------------------------------*/
+void _linkTimer(byte id, unsigned int delay) {
+  if (delay == 0) delay = 1;
+  _soft_timer * timer = &_timers[id];
+  unsigned long expires;
+  if (_timer_servicing) {
+    expires = _timer_serviced + delay;
+  }
+  else {
+    byte oldSREG = SREG;
+    cli();
+    if (!_timer_pending) _timer_serviced = _timer_ticks;
+    expires = _timer_ticks + delay;
+    SREG = oldSREG;
+  }
+  timer->rounds = (expires - _timer_serviced - 1) / TIMER_WHEEL_SLOTS;
+  timer->slot = expires & TIMER_WHEEL_MASK;
+  timer->prev = TIMER_NONE;
+  timer->next = _timer_wheel[timer->slot];
+  if (timer->next != TIMER_NONE) _timers[timer->next].prev = id;
+  _timer_wheel[timer->slot] = id;
+
+  /* serviceTimers() has fallen behind the interrupt, so the tick that
+     would have raised the flag for this timer may already be gone */
+  if ((long)(timerMillis() - expires) >= 0) _timer_pending = true;
+}
+
+void _unlinkTimer(byte id) {
+  _soft_timer * timer = &_timers[id];
+  if (timer->prev != TIMER_NONE) _timers[timer->prev].next = timer->next;
+  else _timer_wheel[timer->slot] = timer->next;
+  if (timer->next != TIMER_NONE) _timers[timer->next].prev = timer->prev;
+}
+
+void _freeTimer(byte id) {
+  _timers[id].slot = TIMER_NONE;
+  _timers[id].next = _timer_free;
+  _timer_free = id;
+}
+
+/*-------------------------------- START TIMER ------------------------------*/
+/*
+ *   Calls callback after delay milliseconds, and then every period
+ *   milliseconds if period is not 0. Returns an id for cancelTimer(), or
+ *   TIMER_NONE if all TIMER_COUNT timers are in use. A one shot timer's id
+ *   is free for reuse as soon as its callback has been called.
+ */
+/*---------------------------------------------------------------------------*/
+byte startTimer(unsigned int delay, TimerCallback callback, unsigned int period) {
+  byte id = _timer_free;
+  if (id == TIMER_NONE) return TIMER_NONE;
+  _timer_free = _timers[id].next;
+  _timers[id].callback = callback;
+  _timers[id].period = period;
+  _timers[id].due = false;
+  _linkTimer(id, delay);
+  return id;
+}
+byte startTimer(unsigned int delay, TimerCallback callback) {
+  return startTimer(delay, callback, 0);
+}
+
+/*------------------------------- CANCEL TIMER ------------------------------*/
+/*
+ *   Stops a timer before its callback runs, even one that expired on the
+ *   same tick as the callback cancelling it. Cancelling TIMER_NONE or a
+ *   timer that has already been freed does nothing.
+ */
+/*---------------------------------------------------------------------------*/
+void cancelTimer(byte id) {
+  if (id >= TIMER_COUNT || _timers[id].slot == TIMER_NONE) return;
+  if (_timers[id].slot != TIMER_EXPIRED) _unlinkTimer(id);
+  _timers[id].due = false;
+  _freeTimer(id);
+}
+
+/*------------------------------ SERVICE TIMERS -----------------------------*/
+/*
+ *   Walks the wheel forward to the current tick and calls every callback
+ *   that has expired. Returns straight away unless the interrupt has seen a
+ *   slot with timers in it, so it is cheap enough to call all the time.
+ *   Expired timers are taken out of the slot before any callback runs, so a
+ *   callback is free to start or cancel timers, and a callback that waits
+ *   in delay() does not run the wheel again from inside itself. A one shot
+ *   keeps its id until its callback is about to run, so a timer cancelled
+ *   by an earlier callback on the same tick is skipped and not reused.
+ */
+/*---------------------------------------------------------------------------*/
+void serviceTimers() {
+  if (!_timer_pending || _timer_servicing) return;
+  _timer_pending = false;
+  _timer_servicing = true;
+  unsigned long now = timerMillis();
+
+  while (_timer_serviced != now) {
+    _timer_serviced++;
+    byte expired[TIMER_COUNT];
+    byte count = 0;
+
+    byte id = _timer_wheel[_timer_serviced & TIMER_WHEEL_MASK];
+    while (id != TIMER_NONE) {
+      _soft_timer * timer = &_timers[id];
+      byte next = timer->next;
+      if (timer->rounds > 0) {
+        timer->rounds--;
+      }
+      else {
+        expired[count++] = id;
+        timer->due = true;
+        _unlinkTimer(id);
+        if (timer->period != 0) _linkTimer(id, timer->period);
+        else timer->slot = TIMER_EXPIRED;
+      }
+      id = next;
+    }
+
+    for (byte i = 0; i < count; i++) {
+      _soft_timer * timer = &_timers[expired[i]];
+      if (!timer->due) continue;   // cancelled by an earlier callback
+      timer->due = false;
+      TimerCallback callback = timer->callback;
+      if (timer->slot == TIMER_EXPIRED) _freeTimer(expired[i]);
+      callback();
+    }
+  }
+  _timer_servicing = false;
+}
+
+/*------------------------------ TIMER INTERRUPT ----------------------------*/
+/*
+ *   Runs every millisecond. It never touches the timers themselves, it only
+ *   flags that the slot for this tick has something in it. It also gives
+ *   cubehelper.h the chance to wake the display when it is idle.
+ */
+/*---------------------------------------------------------------------------*/
+void _displayTick();
+
+ISR(TIMER1_COMPA_vect) {
+  _timer_ticks++;
+  if (_timer_wheel[_timer_ticks & TIMER_WHEEL_MASK] != TIMER_NONE) {
+    _timer_pending = true;
+  }
+  _displayTick();
+}
+
+#endif
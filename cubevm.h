@@ -0,0 +1,331 @@
+/******************************************************************************\
+| CUBEVM.H                                                                     |
+|                                                                              |
+| A small register based bytecode interpreter for cube animations. Programs    |
+| are read from PROGMEM or EEPROM, so a new animation can be uploaded over     |
+| serial without reflashing the sketch. tools/cubeasm.cpp assembles programs   |
+| and can also run them on a Linux machine for testing.                        |
+\******************************************************************************/
+
+#ifndef _CUBEVM_H_
+#define _CUBEVM_H_
+
+#include "cuberandom.h"
+
+#ifdef ARDUINO
+#include "cubehelper.h"
+#include <avr/pgmspace.h>
+#include <avr/eeprom.h>
+#endif
+
+/*--------------------------------- OPCODES ---------------------------------*/
+/*
+ *   Every instruction is one opcode byte followed by its operands. Registers
+ *   are written r0 to r15 and two register operands share one byte, high
+ *   nibble first. Addresses and WAIT times are 16 bit little endian.
+ *
+ *   END                       stop the program
+ *   LDI  rd, imm              rd = imm
+ *   MOV  rd, rs               rd = rs
+ *   ADD  rd, rs               rd = rd + rs
+ *   SUB  rd, rs               rd = rd - rs
+ *   ADDI rd, imm              rd = rd + imm (imm may be negative)
+ *   RAND rd, lo, hi           rd = random number from lo to hi-1 (vm_random)
+ *   PAL  index, color         set palette entry index (0 to 7) to a color
+ *   DRAW rc, rb, rx, ry, rz   light one LED with palette color rc
+ *   FILL rc, rb               light the whole cube
+ *   ROW  rc, rb, rz           light the whole layer rz
+ *   FADE imm                  dim every lit LED by imm
+ *   CLEAR                     clearBuffer()
+ *   SHOW                      flushBuffer()
+ *   WAIT ms                   delay(ms), ending early with the pattern
+ *   LOOP rc, label            if (--rc != 0) jump to label
+ *   JMP  label                jump to label
+ *
+ *   The opcodes are numbered without gaps so the switch in runVm() is
+ *   compiled into a jump table instead of a chain of compares.
+ */
+/*---------------------------------------------------------------------------*/
+#define VM_END   0x00
+#define VM_LDI   0x01
+#define VM_MOV   0x02
+#define VM_ADD   0x03
+#define VM_ADDI  0x04
+#define VM_RAND  0x05
+#define VM_PAL   0x06
+#define VM_DRAW  0x07
+#define VM_FILL  0x08
+#define VM_ROW   0x09
+#define VM_FADE  0x0A
+#define VM_CLEAR 0x0B
+#define VM_SHOW  0x0C
+#define VM_WAIT  0x0D
+#define VM_LOOP  0x0E
+#define VM_JMP   0x0F
+#define VM_SUB   0x10
+
+#define VM_REGISTERS 16
+#define VM_PALETTE 8
+
+/* Programs can be run straight out of flash or out of the EEPROM upload area. */
+#define VM_SOURCE_PROGMEM 0
+#define VM_SOURCE_EEPROM  1
+
+/* An uploaded program is stored behind a four byte header: 'C' 'V' length. */
+#define VM_EEPROM_BASE 0
+#define VM_EEPROM_SIZE 768
+#define VM_EEPROM_HEADER 4
+#define VM_UPLOAD_CHUNK 32
+
+byte vm_registers[VM_REGISTERS];
+char vm_palette[VM_PALETTE];
+byte vm_source = VM_SOURCE_PROGMEM;
+const byte * vm_program = 0;
+unsigned int vm_length = 0;
+CubeRandom vm_random;
+bool vm_program_changed = false;   // set by an upload, stops runVm()
+
+#ifdef CUBE_VM_STATS
+unsigned long vm_instructions = 0;
+#endif
+
+/*---------------------------------- VM LOAD --------------------------------*/
+/*
+ *   These functions select the program that runVm() will execute. The
+ *   EEPROM version returns false when no valid program has been uploaded.
+ */
+/*---------------------------------------------------------------------------*/
+void vmLoadProgmem(const byte * program, unsigned int length) {
+  vm_source = VM_SOURCE_PROGMEM;
+  vm_program = program;
+  vm_length = length;
+}
+
+bool vmLoadEeprom() {
+  const byte * header = (const byte *)VM_EEPROM_BASE;
+  if (eeprom_read_byte(header) != 'C' || eeprom_read_byte(header+1) != 'V') {
+    return false;
+  }
+  unsigned int length = eeprom_read_byte(header+2) | (eeprom_read_byte(header+3) << 8);
+  if (length > VM_EEPROM_SIZE - VM_EEPROM_HEADER) {
+    return false;
+  }
+  vm_source = VM_SOURCE_EEPROM;
+  vm_program = header + VM_EEPROM_HEADER;
+  vm_length = length;
+  return true;
+}
+
+/*---------------------------------- VM FETCH -------------------------------*/
+/*
+ *   Reads the byte at pc from wherever the current program is stored. Reading
+ *   past the end of the program returns END so a truncated program stops.
+ */
+/*---------------------------------------------------------------------------*/
+inline byte vmFetch(unsigned int pc) {
+  if (pc >= vm_length) return VM_END;
+  if (vm_source == VM_SOURCE_PROGMEM) return pgm_read_byte(vm_program + pc);
+  return eeprom_read_byte(vm_program + pc);
+}
+
+/*---------------------------------- VM PLOT --------------------------------*/
+/*
+ *   Adds the brightness to one LED the same way drawLed() does, but looks the
+ *   color up in the palette and writes the color planes directly.
+ */
+/*---------------------------------------------------------------------------*/
+inline void vmPlot(byte color, byte brightness, byte led) {
+  char code = vm_palette[color & (VM_PALETTE-1)];
+  if (code < 0) {
+    _cube_buffer[led] = 0;
+    _cube_buffer[led+64] = 0;
+    _cube_buffer[led+128] = 0;
+    return;
+  }
+  if (code > 6) return;
+  byte planes = _color_planes[(byte)code];
+  if (planes & 0x01) { _cube_buffer[led]     += brightness; markLit(_cube_buffer, led); }
+  if (planes & 0x02) { _cube_buffer[led+64]  += brightness; markLit(_cube_buffer, led+64); }
+  if (planes & 0x04) { _cube_buffer[led+128] += brightness; markLit(_cube_buffer, led+128); }
+}
+
+/*----------------------------------- RUN VM --------------------------------*/
+/*
+ *   Runs the loaded program until it reaches END, or until duration
+ *   milliseconds have passed and the pattern timer stops it. An upload
+ *   stops it too, since the program it was running is gone: the next
+ *   vmLoadEeprom() picks up the new one. WAIT sleeps a millisecond at a
+ *   time so it ends with the pattern. The palette starts out as red,
+ *   green, blue, yellow, teal, purple, white, off.
+ */
+/*---------------------------------------------------------------------------*/
+void runVm(unsigned long duration) {
+  unsigned int pc = 0;
+
+  for (int i = 0; i < VM_REGISTERS; i++) vm_registers[i] = 0;
+  for (int i = 0; i < VM_PALETTE-1; i++) vm_palette[i] = i;
+  vm_palette[VM_PALETTE-1] = -7;
+
+  vm_program_changed = false;
+  startPatternTimer(duration);
+  while (continuePattern && !vm_program_changed) {
+    byte op = vmFetch(pc++);
+    byte a, b;
+#ifdef CUBE_VM_STATS
+    vm_instructions++;
+#endif
+    switch (op) {
+      case VM_END:
+        return;
+      case VM_LDI:
+        a = vmFetch(pc++);
+        vm_registers[a & 0x0F] = vmFetch(pc++);
+        break;
+      case VM_MOV:
+        a = vmFetch(pc++);
+        vm_registers[a >> 4] = vm_registers[a & 0x0F];
+        break;
+      case VM_ADD:
+        a = vmFetch(pc++);
+        vm_registers[a >> 4] += vm_registers[a & 0x0F];
+        break;
+      case VM_SUB:
+        a = vmFetch(pc++);
+        vm_registers[a >> 4] -= vm_registers[a & 0x0F];
+        break;
+      case VM_ADDI:
+        a = vmFetch(pc++);
+        vm_registers[a & 0x0F] += vmFetch(pc++);
+        break;
+      case VM_RAND:
+        a = vmFetch(pc++);
+        b = vmFetch(pc++);
+        vm_registers[a & 0x0F] = randomRange(vm_random, b, vmFetch(pc++));
+        break;
+      case VM_PAL:
+        a = vmFetch(pc++);
+        vm_palette[a & (VM_PALETTE-1)] = (char)vmFetch(pc++);
+        break;
+      case VM_DRAW: {
+        a = vmFetch(pc++);
+        b = vmFetch(pc++);
+        byte z = vmFetch(pc++);
+        byte led = ((vm_registers[b >> 4] & 3) << 4)
+                 | ((vm_registers[b & 0x0F] & 3) << 2)
+                 |  (vm_registers[z & 0x0F] & 3);
+        vmPlot(vm_registers[a >> 4], vm_registers[a & 0x0F], led);
+        break;
+      }
+      case VM_FILL:
+        a = vmFetch(pc++);
+        for (byte led = 0; led < 64; led++) {
+          vmPlot(vm_registers[a >> 4], vm_registers[a & 0x0F], led);
+        }
+        break;
+      case VM_ROW: {
+        a = vmFetch(pc++);
+        byte z = vm_registers[vmFetch(pc++) & 0x0F] & 3;
+        for (byte led = z; led < 64; led += 4) {
+          vmPlot(vm_registers[a >> 4], vm_registers[a & 0x0F], led);
+        }
+        break;
+      }
+      case VM_FADE:
+        a = vmFetch(pc++);
+        for (int i = 0; i < BUFFERSIZE; i++) {
+          byte level = _cube_buffer[i];
+          _cube_buffer[i] = level > a ? level - a : 0;
+        }
+        break;
+      case VM_CLEAR:
+        clearBuffer();
+        break;
+      case VM_SHOW:
+        flushBuffer();
+        break;
+      case VM_WAIT: {
+        a = vmFetch(pc++);
+        unsigned long end = millis() + (a | (vmFetch(pc++) << 8));
+        while (continuePattern && !vm_program_changed && (long)(millis() - end) < 0) {
+          delay(1);
+        }
+        break;
+      }
+      case VM_LOOP:
+        a = vmFetch(pc++);
+        if (--vm_registers[a & 0x0F] != 0) {
+          pc = vmFetch(pc) | (vmFetch(pc+1) << 8);
+        }
+        else {
+          pc += 2;
+        }
+        break;
+      case VM_JMP:
+        pc = vmFetch(pc) | (vmFetch(pc+1) << 8);
+        break;
+      default:
+        return;
+    }
+  }
+}
+
+#ifdef ARDUINO
+/*----------------------------- VM RECEIVE PROGRAM --------------------------*/
+/*
+ *   Checks the serial port for an uploaded program and stores it in EEPROM.
+ *   The upload is 'U', a 16 bit length, the program and a checksum byte (the
+ *   sum of the program bytes). Writing EEPROM is slower than 9600 baud, so
+ *   the program is sent in chunks of VM_UPLOAD_CHUNK bytes and each chunk is
+ *   acknowledged with a '.' once it has been written.
+ */
+/*---------------------------------------------------------------------------*/
+bool vmReceiveProgram() {
+  if (Serial.available() == 0 || Serial.peek() != 'U') {
+    return false;
+  }
+  Serial.read();
+
+  byte chunk[VM_UPLOAD_CHUNK];
+  if (Serial.readBytes(chunk, 2) != 2) return false;
+  unsigned int length = chunk[0] | (chunk[1] << 8);
+  if (length > VM_EEPROM_SIZE - VM_EEPROM_HEADER) {
+    Serial.println(F("vm: program too long"));
+    return false;
+  }
+
+  /* invalidate the old program first so a failed upload never runs */
+  byte * header = (byte *)VM_EEPROM_BASE;
+  vm_program_changed = true;
+  eeprom_update_byte(header, 0);
+  Serial.write('.');
+
+  byte sum = 0;
+  for (unsigned int done = 0; done < length; ) {
+    unsigned int count = length - done;
+    if (count > VM_UPLOAD_CHUNK) count = VM_UPLOAD_CHUNK;
+    if (Serial.readBytes(chunk, count) != count) {
+      Serial.println(F("vm: upload timed out"));
+      return false;
+    }
+    for (unsigned int i = 0; i < count; i++) {
+      eeprom_update_byte(header + VM_EEPROM_HEADER + done + i, chunk[i]);
+      sum += chunk[i];
+    }
+    done += count;
+    Serial.write('.');
+  }
+
+  if (Serial.readBytes(chunk, 1) != 1 || chunk[0] != sum) {
+    Serial.println(F("vm: bad checksum"));
+    return false;
+  }
+  eeprom_update_byte(header+2, length & 0xFF);
+  eeprom_update_byte(header+3, length >> 8);
+  eeprom_update_byte(header+1, 'V');
+  eeprom_update_byte(header, 'C');
+  Serial.println(F("vm: ok"));
+  return true;
+}
+#endif
+
+#endif
@@ -174,20 +174,27 @@ void setTimer1Mode (int mode);
 void setTimer1Prescaler(int prescaler);
 void setTimer1Value(byte value);
 byte getTimer1Value(byte value);
-void setTimer1OutputCompareA(byte value);
-void setTimer1OutputCompareB(byte value);
+void setTimer1OutputCompareA(unsigned int value);
+void setTimer1OutputCompareB(unsigned int value);
 
 /****************************** SET TIMER 1 MODE ******************************\
 | This function still needs some more work because i dont understand compleetly|
 | what each mode does                                                          |
-| 
+| Mode 4 (CTC) clears the counter when it reaches OCR1A, so the compare A      |
+| interrupt fires every OCR1A+1 timer ticks.                                   |
 \******************************************************************************/
 #define TIMER1_NORMAL 0
+#define TIMER1_CTC 4
 void setTimer1Mode (int mode) {
   if (mode == 0) {
     TCCR1A &= ~((1<<WGM11) | (1<<WGM10));
     TCCR1B &= ~((1<<WGM12) | (1<<WGM13));
   }
+  else if (mode == 4) {
+    TCCR1A &= ~((1<<WGM11) | (1<<WGM10));
+    TCCR1B &= ~(1<<WGM13);
+    TCCR1B |=  (1<<WGM12);
+  }
 }
 /**************************** SET TIMER 1 PRESCALER ***************************\
 | The timer 1 prescaler determines when the timer is incremented. If the       |
@@ -218,14 +225,14 @@ byte getTimer1Value()           {return TCNT1; }
 | compared with the counter value (TCNT1). A match can be used to generate an  |
 | Output Compare interrupt, or to generate a waveform output on the OC0A pin.  |
 \******************************************************************************/
-void setTimer1OutputCompareA(byte value) { OCR1A = value; }
+void setTimer1OutputCompareA(unsigned int value) { OCR1A = value; }
 
 /************************ SET TIMER 1 OUTPUT COMPARE B ************************\
 | The Output Compare Register B contains an 8-bit value that is continuously   |
 | compared with the counter value (TCNT1). A match can be used to generate an  |
 | Output Compare interrupt, or to generate a waveform output on the OC0B pin.  |
 \******************************************************************************/
-void setTimer1OutputCompareB(byte value) { OCR1B = value; }
+void setTimer1OutputCompareB(unsigned int value) { OCR1B = value; }
 
 
   //////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,310 @@
+/******************************************************************************\
+| CUBEASM.CPP                                                                  |
+|                                                                              |
+| Assembler and host interpreter for the cube bytecode VM in cubevm.h.         |
+|                                                                              |
+|   g++ -O2 -o cubeasm tools/cubeasm.cpp                                       |
+|   ./cubeasm prog.cas -o prog.bin      write the raw program                  |
+|   ./cubeasm prog.cas -c name          print a PROGMEM array for the sketch   |
+|   ./cubeasm prog.cas -r [-t ms] [-s seed] [-l frames.log]                    |
+|                                       run it on the host, print stats        |
+|   ./cubeasm prog.cas -u /dev/ttyACM0  upload it into the cube's EEPROM       |
+\******************************************************************************/
+
+#include <stdio.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <termios.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include <map>
+
+#include "hostshim.h"
+#define CUBE_VM_STATS
+#include "../cubevm.h"
+
+struct Mnemonic {
+  const char * name;
+  byte opcode;
+  const char * operands; // r = register, i = immediate, c = color, l = label, w = 16 bit
+};
+
+/* Operands marked with the same letter twice in a row are packed into one byte. */
+const Mnemonic mnemonics[] = {
+  {"END",   VM_END,   ""},
+  {"LDI",   VM_LDI,   "ri"},
+  {"MOV",   VM_MOV,   "RR"},
+  {"ADD",   VM_ADD,   "RR"},
+  {"SUB",   VM_SUB,   "RR"},
+  {"ADDI",  VM_ADDI,  "ri"},
+  {"RAND",  VM_RAND,  "rii"},
+  {"PAL",   VM_PAL,   "ic"},
+  {"DRAW",  VM_DRAW,  "RRRRr"},
+  {"FILL",  VM_FILL,  "RR"},
+  {"ROW",   VM_ROW,   "RRr"},
+  {"FADE",  VM_FADE,  "i"},
+  {"CLEAR", VM_CLEAR, ""},
+  {"SHOW",  VM_SHOW,  ""},
+  {"WAIT",  VM_WAIT,  "w"},
+  {"LOOP",  VM_LOOP,  "rl"},
+  {"JMP",   VM_JMP,   "l"},
+};
+
+const char * colors[] = {"red","green","blue","yellow","teal","purple","white"};
+
+int line_number = 0;
+
+void fail(const char * message, const std::string & detail) {
+  fprintf(stderr, "line %d: %s '%s'\n", line_number, message, detail.c_str());
+  exit(1);
+}
+
+std::string upper(std::string text) {
+  for (size_t i = 0; i < text.size(); i++) text[i] = toupper(text[i]);
+  return text;
+}
+
+long parseNumber(const std::string & text) {
+  char * end;
+  long value = strtol(text.c_str(), &end, 0);
+  if (text.empty() || *end != 0) fail("bad number", text);
+  return value;
+}
+
+int parseRegister(const std::string & text) {
+  if (text.size() < 2 || tolower(text[0]) != 'r') fail("expected a register", text);
+  long value = parseNumber(text.substr(1));
+  if (value < 0 || value >= VM_REGISTERS) fail("no such register", text);
+  return value;
+}
+
+int parseColor(const std::string & text) {
+  for (int i = 0; i < 7; i++) {
+    if (text == colors[i]) return i;
+  }
+  if (text == "off") return -7;
+  return parseNumber(text);
+}
+
+/*-------------------------------- ASSEMBLE ---------------------------------*/
+/*
+ *   Two passes over the source: the first one records where every label is,
+ *   the second one emits the bytes. Comments start with ';' or '#'.
+ */
+/*---------------------------------------------------------------------------*/
+std::vector<byte> assemble(FILE * source) {
+  std::vector<std::vector<std::string> > lines;
+  std::vector<int> numbers;
+  std::map<std::string, int> labels;
+  char text[256];
+
+  int address = 0;
+  for (line_number = 1; fgets(text, sizeof(text), source); line_number++) {
+    std::string line(text);
+    size_t comment = line.find_first_of(";#");
+    if (comment != std::string::npos) line.erase(comment);
+    for (size_t i = 0; i < line.size(); i++) {
+      if (line[i] == ',') line[i] = ' ';
+    }
+
+    std::vector<std::string> words;
+    char word[256];
+    int offset = 0, used;
+    while (sscanf(line.c_str() + offset, "%255s%n", word, &used) == 1) {
+      words.push_back(word);
+      offset += used;
+    }
+    if (!words.empty() && words[0][words[0].size()-1] == ':') {
+      labels[words[0].substr(0, words[0].size()-1)] = address;
+      words.erase(words.begin());
+    }
+    if (words.empty()) continue;
+
+    const Mnemonic * mnemonic = 0;
+    for (size_t i = 0; i < sizeof(mnemonics)/sizeof(mnemonics[0]); i++) {
+      if (upper(words[0]) == mnemonics[i].name) mnemonic = &mnemonics[i];
+    }
+    if (!mnemonic) fail("unknown instruction", words[0]);
+    if (words.size() - 1 != strlen(mnemonic->operands)) fail("wrong operand count for", words[0]);
+
+    address++;
+    for (const char * kind = mnemonic->operands; *kind; kind++) {
+      if (*kind == 'R') kind++;
+      address += (*kind == 'l' || *kind == 'w') ? 2 : 1;
+    }
+    lines.push_back(words);
+    numbers.push_back(line_number);
+  }
+
+  std::vector<byte> program;
+  for (size_t l = 0; l < lines.size(); l++) {
+    std::vector<std::string> & words = lines[l];
+    line_number = numbers[l];
+    const Mnemonic * mnemonic = 0;
+    for (size_t i = 0; i < sizeof(mnemonics)/sizeof(mnemonics[0]); i++) {
+      if (upper(words[0]) == mnemonics[i].name) mnemonic = &mnemonics[i];
+    }
+    program.push_back(mnemonic->opcode);
+
+    size_t operand = 1;
+    for (const char * kind = mnemonic->operands; *kind; kind++, operand++) {
+      const std::string & word = words[operand];
+      if (*kind == 'R') {
+        int high = parseRegister(word);
+        int low = parseRegister(words[++operand]);
+        kind++;
+        program.push_back((high << 4) | low);
+      }
+      else if (*kind == 'r') {
+        program.push_back(parseRegister(word));
+      }
+      else if (*kind == 'i') {
+        long value = parseNumber(word);
+        if (value < -128 || value > 255) fail("immediate out of range", word);
+        program.push_back(value & 0xFF);
+      }
+      else if (*kind == 'c') {
+        program.push_back(parseColor(word) & 0xFF);
+      }
+      else {
+        long value;
+        if (*kind == 'l') {
+          if (labels.find(word) == labels.end()) fail("unknown label", word);
+          value = labels[word];
+        }
+        else {
+          value = parseNumber(word);
+        }
+        if (value < 0 || value > 0xFFFF) fail("value out of range", word);
+        program.push_back(value & 0xFF);
+        program.push_back(value >> 8);
+      }
+    }
+  }
+  return program;
+}
+
+/*---------------------------------- RUN ------------------------------------*/
+/*
+ *   Runs the program on the host through hostshim.h and reports how many
+ *   instructions it executed for each frame it showed. With a log file the
+ *   frames are also written to it for tools/cubeplay.cpp.
+ */
+/*---------------------------------------------------------------------------*/
+unsigned long frames = 0;
+void countFrame(const char * /*buffer*/) { frames++; }
+
+void run(const std::vector<byte> & program, unsigned long duration, uint32_t seed, const char * log) {
+  seedRandom(vm_random, seed, 3);
+  host_frame_callback = countFrame;
+  if (log) {
+    host_frame_log = fopen(log, "wb");
+    if (!host_frame_log) { perror(log); exit(1); }
+  }
+  vmLoadProgmem(&program[0], program.size());
+  runVm(duration);
+
+  printf("%lu frames in %lums of simulated time\n", frames, host_millis);
+  printf("%lu instructions, %.1f per frame\n", vm_instructions,
+         frames ? (double)vm_instructions / frames : 0.0);
+  if (host_frame_log) fclose(host_frame_log);
+}
+
+/*--------------------------------- UPLOAD ----------------------------------*/
+/*
+ *   Sends the program to vmReceiveProgram() at 9600 baud, waiting for the
+ *   '.' acknowledgement after the header and after every chunk.
+ */
+/*---------------------------------------------------------------------------*/
+bool waitForAck(int port) {
+  char reply;
+  for (int tries = 0; tries < 50; tries++) {
+    if (read(port, &reply, 1) == 1 && reply == '.') return true;
+  }
+  return false;
+}
+
+void upload(const std::vector<byte> & program, const char * device) {
+  int port = open(device, O_RDWR | O_NOCTTY);
+  if (port < 0) { perror(device); exit(1); }
+
+  termios settings;
+  tcgetattr(port, &settings);
+  cfmakeraw(&settings);
+  cfsetispeed(&settings, B9600);
+  cfsetospeed(&settings, B9600);
+  settings.c_cc[VMIN] = 0;
+  settings.c_cc[VTIME] = 1;
+  tcsetattr(port, TCSANOW, &settings);
+  sleep(2); // opening the port resets the Arduino
+  tcflush(port, TCIFLUSH);
+
+  byte header[3] = {'U', (byte)(program.size() & 0xFF), (byte)(program.size() >> 8)};
+  write(port, header, 3);
+  if (!waitForAck(port)) { fprintf(stderr, "no reply from %s\n", device); exit(1); }
+
+  byte sum = 0;
+  for (size_t done = 0; done < program.size(); done += VM_UPLOAD_CHUNK) {
+    size_t count = program.size() - done;
+    if (count > VM_UPLOAD_CHUNK) count = VM_UPLOAD_CHUNK;
+    write(port, &program[done], count);
+    for (size_t i = 0; i < count; i++) sum += program[done+i];
+    if (!waitForAck(port)) { fprintf(stderr, "upload stalled at byte %zu\n", done); exit(1); }
+  }
+  write(port, &sum, 1);
+
+  char reply[64] = {0};
+  usleep(200000);
+  read(port, reply, sizeof(reply)-1);
+  printf("%s", reply);
+  close(port);
+}
+
+int main(int argc, char ** argv) {
+  if (argc < 3) {
+    fprintf(stderr, "usage: %s source.cas (-o file | -c name | -r [-t ms] [-s seed] [-l log] | -u device)\n", argv[0]);
+    return 1;
+  }
+  FILE * source = fopen(argv[1], "r");
+  if (!source) { perror(argv[1]); return 1; }
+  std::vector<byte> program = assemble(source);
+  fclose(source);
+  if (program.size() > VM_EEPROM_SIZE - VM_EEPROM_HEADER) {
+    fprintf(stderr, "warning: %zu bytes will not fit in EEPROM\n", program.size());
+  }
+
+  std::string mode = argv[2];
+  if (mode == "-o" && argc > 3) {
+    FILE * out = fopen(argv[3], "wb");
+    if (!out) { perror(argv[3]); return 1; }
+    fwrite(&program[0], 1, program.size(), out);
+    fclose(out);
+  }
+  else if (mode == "-c" && argc > 3) {
+    printf("const byte %s[] PROGMEM = {", argv[3]);
+    for (size_t i = 0; i < program.size(); i++) {
+      printf("%s0x%02X", i ? (i % 12 ? "," : ",\n  ") : "\n  ", program[i]);
+    }
+    printf("\n};\n");
+  }
+  else if (mode == "-r") {
+    unsigned long duration = 5000;
+    uint32_t seed = 2019;
+    const char * log = 0;
+    for (int i = 3; i+1 < argc; i += 2) {
+      if (std::string(argv[i]) == "-t") duration = parseNumber(argv[i+1]);
+      if (std::string(argv[i]) == "-s") seed = parseNumber(argv[i+1]);
+      if (std::string(argv[i]) == "-l") log = argv[i+1];
+    }
+    run(program, duration, seed, log);
+  }
+  else if (mode == "-u" && argc > 3) {
+    upload(program, argv[3]);
+  }
+  else {
+    fprintf(stderr, "unknown option %s\n", argv[2]);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,165 @@
+/******************************************************************************\
+| CUBEBAKE.CPP                                                                 |
+|                                                                              |
+| Renders the show from cubepatterns.h on the host. Every frame only depends   |
+| on its time and the seed, so a long show is split into chunks that are       |
+| rendered on separate threads and then joined back together.                  |
+|                                                                              |
+|   g++ -O2 -pthread -o cubebake tools/cubebake.cpp                            |
+|   ./cubebake [-s seed] [-t start] [-d ms] [-f frame_ms] [-j threads]        |
+|              [-o frames.bin] [-l frames.log] [-v]                            |
+|                                                                              |
+| -o writes every frame as 192 raw buffer bytes. -l writes the frames as a     |
+| cubelog.h log for tools/cubeplay.cpp and times the encoder. -v renders the   |
+| show again on one thread, in order, and checks that every frame matches.     |
+\******************************************************************************/
+
+#include <stdio.h>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "hostshim.h"
+#include "../cubepatterns.h"
+
+struct Bake {
+  uint32_t seed;
+  unsigned long start;
+  unsigned long frameTime;
+  std::vector<char> frames;
+};
+
+/*-------------------------------- BAKE CHUNK -------------------------------*/
+/*
+ *   Renders frames first to last-1 of the bake into their place in frames.
+ */
+/*---------------------------------------------------------------------------*/
+void bakeChunk(Bake * bake, size_t first, size_t last) {
+  for (size_t i = first; i < last; i++) {
+    renderShow(bake->start + i*bake->frameTime, bake->seed, &bake->frames[i*BUFFERSIZE]);
+  }
+}
+
+void bakeShow(Bake & bake, size_t count, unsigned int threads) {
+  bake.frames.assign(count*BUFFERSIZE, 0);
+  std::vector<std::thread> workers;
+  for (unsigned int j = 0; j < threads; j++) {
+    size_t first = count * j / threads;
+    size_t last = count * (j+1) / threads;
+    workers.push_back(std::thread(bakeChunk, &bake, first, last));
+  }
+  for (size_t j = 0; j < workers.size(); j++) {
+    workers[j].join();
+  }
+}
+
+/*--------------------------------- WRITE LOG -------------------------------*/
+/*
+ *   Encodes the bake as a frame log and prints how long encodeFrame() took
+ *   per frame, not counting the lit masks, which the cube keeps as it draws.
+ */
+/*---------------------------------------------------------------------------*/
+bool writeLog(const Bake & bake, size_t count, const char * path) {
+  std::vector<CubeMask> masks(count*3);
+  for (size_t i = 0; i < count; i++) {
+    for (byte plane = 0; plane < 3; plane++) {
+      masks[i*3 + plane] = maskFromBuffer(&bake.frames[i*BUFFERSIZE], plane);
+    }
+  }
+
+  CubeLog log;
+  resetLog(log);
+  std::vector<uint8_t> data(count*LOG_RECORD_MAX);
+  size_t length = 0;
+  auto begin = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < count; i++) {
+    length += encodeFrame(log, bake.start + i*bake.frameTime, &bake.frames[i*BUFFERSIZE],
+                          &masks[i*3], &data[length], LOG_RECORD_MAX);
+  }
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+  printf("log: %zu bytes, %.1f per frame, encoded in %.0fns per frame\n",
+         length, count ? (double)length / count : 0.0, count ? seconds * 1e9 / count : 0.0);
+
+  FILE * out = fopen(path, "wb");
+  if (!out) { perror(path); return false; }
+  fwrite(data.data(), 1, length, out);
+  fclose(out);
+  return true;
+}
+
+/* 64 bit FNV-1a, to compare bakes without keeping the frames around. */
+uint64_t hashFrames(const char * data, size_t length) {
+  uint64_t hash = 0xCBF29CE484222325ULL;
+  for (size_t i = 0; i < length; i++) {
+    hash = (hash ^ (uint8_t)data[i]) * 0x100000001B3ULL;
+  }
+  return hash;
+}
+
+int main(int argc, char ** argv) {
+  Bake bake;
+  bake.seed = 2019;
+  bake.start = 0;
+  bake.frameTime = 10;
+  unsigned long duration = showLength();
+  unsigned int threads = std::thread::hardware_concurrency();
+  const char * output = 0;
+  const char * logPath = 0;
+  bool verify = false;
+
+  for (int i = 1; i < argc; i++) {
+    std::string option = argv[i];
+    if (option == "-v") { verify = true; continue; }
+    if (i+1 >= argc) { fprintf(stderr, "%s needs a value\n", argv[i]); return 1; }
+    const char * value = argv[++i];
+    if (option == "-s")      bake.seed = strtoul(value, 0, 0);
+    else if (option == "-t") bake.start = strtoul(value, 0, 0);
+    else if (option == "-d") duration = strtoul(value, 0, 0);
+    else if (option == "-f") bake.frameTime = strtoul(value, 0, 0);
+    else if (option == "-j") threads = strtoul(value, 0, 0);
+    else if (option == "-o") output = value;
+    else if (option == "-l") logPath = value;
+    else { fprintf(stderr, "unknown option %s\n", argv[i-1]); return 1; }
+  }
+  if (threads == 0) threads = 1;
+  if (bake.frameTime == 0) { fprintf(stderr, "frame time must be at least 1ms\n"); return 1; }
+
+  size_t count = duration / bake.frameTime;
+  bakeShow(bake, count, threads);
+  uint64_t hash = hashFrames(bake.frames.data(), bake.frames.size());
+  printf("%zu frames from %lums, %u threads, seed %u: %016llx\n",
+         count, bake.start, threads, bake.seed, (unsigned long long)hash);
+
+  /* the time and seed of the first frame of every pattern, for seeking on the cube */
+  const CubePattern * playing = 0;
+  for (size_t i = 0; i < count; i++) {
+    unsigned long t = bake.start + i*bake.frameTime, patternTime;
+    uint32_t patternSeed;
+    const CubePattern * pattern = showPattern(t, bake.seed, patternTime, patternSeed);
+    if (pattern != playing) printf("  %8lums  %s\n", t, pattern->name);
+    playing = pattern;
+  }
+
+  if (verify) {
+    Bake check = bake;
+    bakeShow(check, count, 1);
+    for (size_t i = 0; i < count; i++) {
+      if (memcmp(&check.frames[i*BUFFERSIZE], &bake.frames[i*BUFFERSIZE], BUFFERSIZE) != 0) {
+        printf("frame %zu (%lums) differs between the threaded and the single bake\n",
+               i, bake.start + i*bake.frameTime);
+        return 1;
+      }
+    }
+    printf("verified against a single threaded bake\n");
+  }
+
+  if (output) {
+    FILE * out = fopen(output, "wb");
+    if (!out) { perror(output); return 1; }
+    fwrite(bake.frames.data(), 1, bake.frames.size(), out);
+    fclose(out);
+  }
+  if (logPath && !writeLog(bake, count, logPath)) return 1;
+  return 0;
+}
@@ -0,0 +1,296 @@
+/******************************************************************************\
+| CUBECHECK.CPP                                                                |
+|                                                                              |
+| Checks the timer wheel in cubetimer.h and the display queue in cubehelper.h  |
+| on the simulated ATmega328 from tools/sim, with the real Timer1 and Timer2   |
+| interrupts driving them. Every check prints ok or FAIL, and the exit status  |
+| is the number that failed.                                                   |
+|                                                                              |
+|   g++ -O2 -Itools/sim -o cubecheck tools/cubecheck.cpp                       |
+|   ./cubecheck [-s seed]                                                      |
+\******************************************************************************/
+
+#include "Arduino.h"
+#include "../cubehelper.h"
+
+int failures = 0;
+
+void check(bool good, const char * what) {
+  printf("  %-50s %s\n", what, good ? "ok" : "FAIL");
+  if (!good) failures++;
+}
+
+/*-------------------------------- TIMER CALLS ------------------------------*/
+/*
+ *   The callbacks record the tick they expired on, which is _timer_serviced
+ *   while serviceTimers() runs them, so the checks do not depend on how
+ *   late the main loop got round to it.
+ */
+/*---------------------------------------------------------------------------*/
+#define CALLS_MAX 64
+
+struct TimerCalls {
+  unsigned long ticks[CALLS_MAX];
+  int count;
+};
+
+TimerCalls one_shot, periodic, self_cancel, canceller, cancelled, pair_one, pair_two;
+byte self_cancel_id = TIMER_NONE;
+byte cancelled_id = TIMER_NONE;
+byte pair_one_id = TIMER_NONE;
+byte pair_two_id = TIMER_NONE;
+
+void record(TimerCalls & calls) {
+  if (calls.count < CALLS_MAX) calls.ticks[calls.count] = _timer_serviced;
+  calls.count++;
+}
+
+void oneShotCall()   { record(one_shot); }
+void periodicCall()  { record(periodic); }
+void cancelledCall() { record(cancelled); }
+
+void selfCancelCall() {
+  record(self_cancel);
+  if (self_cancel.count == 3) cancelTimer(self_cancel_id);
+}
+
+void cancellerCall() {
+  record(canceller);
+  cancelTimer(cancelled_id);
+  cancelTimer(cancelled_id);   // a second cancel of a freed timer does nothing
+}
+
+/* Two timers on the same tick that cancel each other, so only the first may run. */
+void pairOneCall() { record(pair_one); cancelTimer(pair_two_id); }
+void pairTwoCall() { record(pair_two); cancelTimer(pair_one_id); }
+
+void nothingCall() {}
+
+/* The number of timers on the free list, or -1 if it is broken. */
+int freeTimers() {
+  bool seen[TIMER_COUNT] = {false};
+  int count = 0;
+  for (byte id = _timer_free; id != TIMER_NONE; id = _timers[id].next) {
+    if (id >= TIMER_COUNT || seen[id] || _timers[id].slot != TIMER_NONE) return -1;
+    seen[id] = true;
+    count++;
+  }
+  return count;
+}
+
+/*-------------------------------- TIMER WHEEL ------------------------------*/
+void checkTimers() {
+  printf("timer wheel\n");
+
+  /* the wheel has been empty since initCube(), so it has not been serviced */
+  delay(100);
+  unsigned long start = timerMillis();
+  startTimer(5, oneShotCall);
+  startTimer(100, oneShotCall);   // more than one turn of the wheel
+  delay(150);
+  check(one_shot.count == 2, "one shots fire once each");
+  check(one_shot.count == 2 && one_shot.ticks[0] == start + 5 && one_shot.ticks[1] == start + 100,
+        "one shots fire on their tick");
+
+  start = timerMillis();
+  byte id = startTimer(3, periodicCall, 7);
+  delay(3 + 7*20 + 2);
+  cancelTimer(id);
+  bool onTime = periodic.count == 21;
+  for (int i = 0; i < periodic.count && i < CALLS_MAX; i++) {
+    if (periodic.ticks[i] != start + 3 + 7*i) onTime = false;
+  }
+  check(onTime, "periodic timer keeps its period");
+  delay(20);
+  check(periodic.count == 21, "cancelled periodic timer stops");
+
+  self_cancel_id = startTimer(2, selfCancelCall, 4);
+  delay(50);
+  check(self_cancel.count == 3, "periodic timer cancels itself from its callback");
+
+  startTimer(10, cancellerCall);
+  cancelled_id = startTimer(20, cancelledCall);
+  delay(40);
+  check(canceller.count == 1 && cancelled.count == 0, "callback cancels a later timer");
+
+  pair_one_id = startTimer(10, pairOneCall);
+  pair_two_id = startTimer(10, pairTwoCall);
+  delay(30);
+  check(pair_one.count + pair_two.count == 1, "callback cancels a one shot due on the same tick");
+
+  pair_one.count = pair_two.count = 0;
+  pair_one_id = startTimer(10, pairOneCall, 7);
+  pair_two_id = startTimer(10, pairTwoCall, 7);
+  delay(40);
+  check((pair_one.count == 0) != (pair_two.count == 0), "callback cancels a periodic timer on its tick");
+  cancelTimer(pair_one_id);
+  cancelTimer(pair_two_id);
+
+  check(freeTimers() == TIMER_COUNT, "every timer is back on the free list");
+  byte ids[TIMER_COUNT];
+  bool started = true;
+  for (int i = 0; i < TIMER_COUNT; i++) {
+    ids[i] = startTimer(1000 + i, nothingCall);
+    if (ids[i] == TIMER_NONE) started = false;
+  }
+  check(started && startTimer(1, nothingCall) == TIMER_NONE, "only TIMER_COUNT timers can run");
+  for (int i = 0; i < TIMER_COUNT; i += 2) cancelTimer(ids[i]);
+  delay(1100);
+  check(freeTimers() == TIMER_COUNT, "free list is whole after cancels and expiry");
+}
+
+/*-------------------------------- FRAME QUEUE ------------------------------*/
+/*
+ *   Flushes QUEUE_FRAMES random frames, from empty to every LED color lit,
+ *   with levels past GAMMA_MAX and marked LEDs that were dimmed back to 0,
+ *   and presentation times that are sometimes already late. Each queued
+ *   frame is compared with a full scan of the buffer, the way flushBuffer()
+ *   built frames before it had the lit masks, and every frame still in the
+ *   queue is compared again after each flush, so a frame that overwrites
+ *   another in the pool is caught. The display interrupt is watched to see
+ *   that it never shows a frame early, never leaves a due frame waiting and
+ *   counts what it skips as dropped.
+ */
+/*---------------------------------------------------------------------------*/
+#define QUEUE_FRAMES 5000
+
+uint32_t check_random = 2019;
+uint32_t checkRandom(uint32_t range) {
+  check_random ^= check_random << 13;
+  check_random ^= check_random >> 17;
+  check_random ^= check_random << 5;
+  return check_random % range;
+}
+
+struct ExpectedFrame {
+  _display_entry entries[BUFFERSIZE];
+  int length;
+};
+
+ExpectedFrame expected_frames[FRAME_QUEUE_SLOTS];
+
+void scanBuffer(ExpectedFrame & frame) {
+  frame.length = 0;
+  for (int i = 0; i < BUFFERSIZE; i++) {
+    byte level = _cube_buffer[i];
+    if (level == 0) continue;
+    if (level > GAMMA_MAX) level = GAMMA_MAX;
+    frame.entries[frame.length].pins = pgm_read_byte(&cube_pins[i]);
+    frame.entries[frame.length].brightness = pgm_read_byte(&cube_gamma[getLedTrim(i)][i / 64][level]);
+    frame.length++;
+  }
+}
+
+/* Whether the queued frame in slot holds what the scan found, blank frames as one dark entry. */
+bool frameMatches(byte slot) {
+  const _queued_frame & frame = _frame_queue[slot & FRAME_QUEUE_MASK];
+  const ExpectedFrame & want = expected_frames[slot & FRAME_QUEUE_MASK];
+  if (frame.lit != want.length) return false;
+  _display_entry * entry = frame.start;
+  int count = 0;
+  while (entry != frame.end) {
+    if (count >= BUFFERSIZE) return false;
+    if (want.length == 0) {
+      if (entry->pins != 0 || entry->brightness != 0) return false;
+    }
+    else if (count >= want.length || entry->pins != want.entries[count].pins ||
+             entry->brightness != want.entries[count].brightness) {
+      return false;
+    }
+    count++;
+    if (++entry == _pool_end) entry = _frame_entries;
+  }
+  return count == (want.length ? want.length : 1);
+}
+
+byte watched_tail = 0;
+unsigned long tail_moves = 0;
+unsigned long tail_dropped = 0;
+unsigned long tail_early = 0;
+unsigned long tail_left_due = 0;
+
+void watchQueue() {
+  byte tail = _queue_tail;
+  if (tail == watched_tail) return;
+  if ((long)(_timer_ticks - _frame_queue[tail & FRAME_QUEUE_MASK].pts) < 0) tail_early++;
+  byte next = tail + 1;
+  if (next != _queue_head && (long)(_timer_ticks - _frame_queue[next & FRAME_QUEUE_MASK].pts) >= 0) {
+    tail_left_due++;
+  }
+  tail_dropped += (byte)(tail - watched_tail - 1);
+  tail_moves++;
+  watched_tail = tail;
+}
+
+void checkQueue() {
+  printf("frame queue, %d frames\n", QUEUE_FRAMES);
+  sim_interrupt_hook = watchQueue;
+  watched_tail = _queue_tail;
+  unsigned int droppedBefore = frames_dropped;
+  unsigned int underrunsBefore = frame_underruns;
+
+  unsigned long entriesWrong = 0, queueWrong = 0, notContiguous = 0, lateExpected = 0;
+  unsigned long wraps = 0, blanks = 0, full = 0;
+  unsigned long pts = timerMillis();
+  for (int n = 0; n < QUEUE_FRAMES; n++) {
+    clearBuffer();
+    uint32_t kind = checkRandom(10);
+    int density = kind == 0 ? 0 : kind == 1 ? BUFFERSIZE : checkRandom(BUFFERSIZE);
+    for (int i = 0; i < BUFFERSIZE; i++) {
+      if ((int)checkRandom(BUFFERSIZE) < density) {
+        _cube_buffer[i] = 1 + checkRandom(GAMMA_MAX + 5);
+        markLit(_cube_buffer, i);
+      }
+      else if (checkRandom(32) == 0) {
+        markLit(_cube_buffer, i);   // marked, then dimmed back to off
+      }
+    }
+
+    // now and then a frame that is already late, but never before the last one
+    unsigned long late = timerMillis() - 5;
+    if (checkRandom(10) == 0 && (long)(late - pts) > 0) pts = late;
+    else pts += checkRandom(13);
+
+    byte slot = _queue_head;
+    _display_entry * previousEnd = _frame_queue[(slot-1) & FRAME_QUEUE_MASK].end;
+    scanBuffer(expected_frames[slot & FRAME_QUEUE_MASK]);
+    if ((long)(timerMillis() - pts) > 0) lateExpected++;
+    flushBufferAt(pts);
+
+    const _queued_frame & frame = _frame_queue[slot & FRAME_QUEUE_MASK];
+    if (frame.start != previousEnd) notContiguous++;
+    if (frame.end <= frame.start && frame.end != _frame_entries) wraps++;
+    if (frame.lit == 0) blanks++;
+    if (frame.lit == BUFFERSIZE) full++;
+    if (!frameMatches(slot)) entriesWrong++;
+    for (byte waiting = _queue_tail + 1; waiting != _queue_head; waiting++) {
+      if (!frameMatches(waiting)) queueWrong++;
+    }
+  }
+  while ((byte)(_queue_head - _queue_tail) > 1) delay(1);
+  delay(5);
+
+  printf("  %lu blank, %lu full, %lu wrapped round the pool\n", blanks, full, wraps);
+  check(entriesWrong == 0, "queued frames match a full scan of the buffer");
+  check(queueWrong == 0, "waiting frames are never overwritten");
+  check(notContiguous == 0, "frames follow each other in the pool");
+  check(wraps > 0 && blanks > 0 && full > 0, "blank, full and wrapping frames were tried");
+  check(frame_underruns - underrunsBefore == lateExpected, "late frames are counted");
+  check(tail_early == 0, "no frame is shown before its time");
+  check(tail_left_due == 0, "the display moves to the newest due frame");
+  check(frames_dropped - droppedBefore == tail_dropped, "skipped frames are counted as dropped");
+  check(_queue_tail == (byte)(_queue_head - 1) && tail_moves + tail_dropped == QUEUE_FRAMES,
+        "every frame is shown or dropped");
+  sim_interrupt_hook = 0;
+}
+
+int main(int argc, char ** argv) {
+  for (int i = 1; i+1 < argc; i += 2) {
+    if (strcmp(argv[i], "-s") == 0) check_random = strtoul(argv[i+1], 0, 0);
+  }
+  initCube();
+  checkTimers();
+  checkQueue();
+  printf("%d failed\n", failures);
+  return failures;
+}
@@ -0,0 +1,291 @@
+/******************************************************************************\
+| CUBEPLAY.CPP                                                                 |
+|                                                                              |
+| Plays back a cubelog.h frame log, as written by the cube with                |
+| CUBE_FRAME_LOG or by cubebake -l, cubeasm -l and cubesim -l. The cube is     |
+| drawn as its four layers side by side, z = 0 on the left, with x across and  |
+| y down each layer. A frame that was logged over several records is only      |
+| drawn once its last record is in.                                            |
+|                                                                              |
+|   g++ -O2 -o cubeplay tools/cubeplay.cpp                                     |
+|   ./cubeplay frames.log [-r] [-p prefix] [-z pixels] [-b]                    |
+|                                                                              |
+| Frames go to the terminal as 24 bit ANSI colors, as fast as they decode or   |
+| at the speed they were logged with -r. -p writes every frame as              |
+| prefix00000.ppm and so on instead, -z pixels wide per LED. -b decodes and    |
+| draws every frame into memory and prints how many frames per second that     |
+| is, without writing anything.                                                |
+\******************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "hostshim.h"
+
+/*-------------------------------- LOG READER -------------------------------*/
+/*
+ *   Steps through the records of a log held in memory. Bytes that do not
+ *   start a record with a good sum are skipped, which is how text that was
+ *   sent on the same serial port gets left out. The 16 bit times are
+ *   unwrapped into a time that keeps counting up.
+ */
+/*---------------------------------------------------------------------------*/
+struct LogChange {
+  uint8_t index;
+  uint8_t level;
+};
+
+struct LogReader {
+  std::vector<uint8_t> data;
+  size_t position;
+  size_t skipped;
+  unsigned long records;
+  bool started;
+  uint16_t lastPts;
+  unsigned long time;
+  uint8_t levels[BUFFERSIZE];
+  LogChange changes[BUFFERSIZE];
+  uint8_t count;
+  bool continued;       // the frame goes on in the next record
+};
+
+bool openLog(LogReader & reader, const char * path) {
+  FILE * in = fopen(path, "rb");
+  if (!in) { perror(path); return false; }
+  uint8_t chunk[65536];
+  size_t got;
+  while ((got = fread(chunk, 1, sizeof(chunk), in)) > 0) {
+    reader.data.insert(reader.data.end(), chunk, chunk + got);
+  }
+  fclose(in);
+  reader.position = reader.skipped = reader.records = 0;
+  reader.started = false;
+  reader.lastPts = 0;
+  reader.time = 0;
+  memset(reader.levels, 0, sizeof(reader.levels));
+  return true;
+}
+
+/* The length of the record at position, or 0 if there is not a good one there. */
+size_t checkRecord(const LogReader & reader, size_t position) {
+  const uint8_t * data = &reader.data[0];
+  size_t left = reader.data.size() - position;
+  if (left < LOG_OVERHEAD) return 0;
+  if (data[position] != LOG_SYNC && data[position] != LOG_SYNC_CONTINUED) return 0;
+  uint8_t count = data[position+1];
+  size_t length = LOG_OVERHEAD + count + (count+1)/2;
+  if (count == 0 || count > BUFFERSIZE || length > left) return 0;
+  uint8_t sum = 0;
+  for (size_t i = 0; i < length-1; i++) sum += data[position+i];
+  return sum == data[position+length-1] ? length : 0;
+}
+
+/* Reads the next record into changes and levels, false at the end of the log. */
+bool nextRecord(LogReader & reader) {
+  size_t length;
+  while (reader.position < reader.data.size()) {
+    length = checkRecord(reader, reader.position);
+    if (length) break;
+    reader.position++;
+    reader.skipped++;
+  }
+  if (reader.position >= reader.data.size()) return false;
+
+  const uint8_t * record = &reader.data[reader.position];
+  uint16_t pts = record[2] | (record[3] << 8);
+  if (reader.started) reader.time += (uint16_t)(pts - reader.lastPts);
+  else reader.time = pts;
+  reader.started = true;
+  reader.lastPts = pts;
+  reader.continued = record[0] == LOG_SYNC_CONTINUED;
+
+  reader.count = 0;
+  const uint8_t * change = record + LOG_HEADER;
+  for (uint8_t i = 0; i < record[1]; i++) {
+    uint8_t index, level;
+    if ((i & 1) == 0) { index = change[0]; level = change[1] & 0x0F; change += 2; }
+    else              { index = change[0]; level = change[-1] >> 4;  change += 1; }
+    if (index >= BUFFERSIZE) continue;
+    reader.levels[index] = level;
+    reader.changes[reader.count].index = index;
+    reader.changes[reader.count].level = level;
+    reader.count++;
+  }
+  reader.position += length;
+  reader.records++;
+  return true;
+}
+
+/*----------------------------------- COLOR ---------------------------------*/
+/*
+ *   The color an LED is drawn in, from the levels of its three planes. Dark
+ *   LEDs are drawn grey so the grid stays visible.
+ */
+/*---------------------------------------------------------------------------*/
+void ledColor(const uint8_t * levels, uint8_t led, uint8_t * rgb) {
+  uint8_t red = levels[led], green = levels[led+64], blue = levels[led+128];
+  if ((red | green | blue) == 0) { rgb[0] = rgb[1] = rgb[2] = 24; return; }
+  rgb[0] = red * 17;
+  rgb[1] = green * 17;
+  rgb[2] = blue * 17;
+}
+
+/* The screen position of an LED, counted in LEDs, with a gap between layers. */
+inline int ledColumn(uint8_t led) { return (led & 3)*5 + (led >> 4); }
+inline int ledRow(uint8_t led)    { return (led >> 2) & 3; }
+
+/*---------------------------------- TERMINAL -------------------------------*/
+/*
+ *   Builds the whole frame as one string of escape codes and writes it at
+ *   once, so a terminal shows it without tearing. Numbers come from a table
+ *   instead of printf.
+ */
+/*---------------------------------------------------------------------------*/
+char number_text[256][4];
+
+void initNumbers() {
+  for (int i = 0; i < 256; i++) snprintf(number_text[i], sizeof(number_text[i]), "%d", i);
+}
+
+void drawTerminal(const LogReader & reader, std::string & out) {
+  out.assign("\x1b[H");
+  char header[64];
+  snprintf(header, sizeof(header), "%8lums  record %lu\x1b[K\n", reader.time, reader.records);
+  out += header;
+  for (int row = 0; row < 4; row++) {
+    for (int z = 0; z < 4; z++) {
+      for (int x = 0; x < 4; x++) {
+        uint8_t rgb[3];
+        ledColor(reader.levels, x*16 + row*4 + z, rgb);
+        out += "\x1b[48;2;";
+        out += number_text[rgb[0]]; out += ';';
+        out += number_text[rgb[1]]; out += ';';
+        out += number_text[rgb[2]]; out += "m  ";
+      }
+      out += "\x1b[0m  ";
+    }
+    out += '\n';
+  }
+  fwrite(out.data(), 1, out.size(), stdout);
+}
+
+/*------------------------------------ PPM ----------------------------------*/
+/*
+ *   One image is kept for the whole log and only the LEDs a record changes
+ *   are painted again, so a frame costs its changes and one write.
+ */
+/*---------------------------------------------------------------------------*/
+struct Picture {
+  int scale;
+  int width, height;
+  std::string header;
+  std::vector<uint8_t> pixels;
+};
+
+void paintLed(Picture & picture, const uint8_t * levels, uint8_t led) {
+  uint8_t rgb[3];
+  ledColor(levels, led, rgb);
+  int left = ledColumn(led) * picture.scale;
+  int top = ledRow(led) * picture.scale;
+  for (int y = 1; y < picture.scale; y++) {     // leave a line between LEDs
+    uint8_t * pixel = &picture.pixels[((top + y) * picture.width + left + 1) * 3];
+    for (int x = 1; x < picture.scale; x++, pixel += 3) {
+      pixel[0] = rgb[0]; pixel[1] = rgb[1]; pixel[2] = rgb[2];
+    }
+  }
+}
+
+void initPicture(Picture & picture, int scale) {
+  picture.scale = scale;
+  picture.width = 19 * scale;
+  picture.height = 4 * scale;
+  char header[32];
+  snprintf(header, sizeof(header), "P6\n%d %d\n255\n", picture.width, picture.height);
+  picture.header = header;
+  picture.pixels.assign(picture.width * picture.height * 3, 0);
+  uint8_t dark[BUFFERSIZE] = {0};
+  for (int led = 0; led < 64; led++) paintLed(picture, dark, led);
+}
+
+void drawPicture(Picture & picture, const LogReader & reader) {
+  for (uint8_t i = 0; i < reader.count; i++) {
+    paintLed(picture, reader.levels, reader.changes[i].index & 63);
+  }
+}
+
+bool writePicture(const Picture & picture, const char * prefix, unsigned long frame) {
+  char path[4096];
+  snprintf(path, sizeof(path), "%s%05lu.ppm", prefix, frame);
+  FILE * out = fopen(path, "wb");
+  if (!out) { perror(path); return false; }
+  fwrite(picture.header.data(), 1, picture.header.size(), out);
+  fwrite(picture.pixels.data(), 1, picture.pixels.size(), out);
+  fclose(out);
+  return true;
+}
+
+int main(int argc, char ** argv) {
+  const char * path = 0;
+  const char * prefix = 0;
+  int scale = 8;
+  bool realtime = false;
+  bool bench = false;
+
+  for (int i = 1; i < argc; i++) {
+    std::string option = argv[i];
+    if (option == "-r") realtime = true;
+    else if (option == "-b") bench = true;
+    else if (option == "-p" && i+1 < argc) prefix = argv[++i];
+    else if (option == "-z" && i+1 < argc) scale = strtoul(argv[++i], 0, 0);
+    else if (option[0] != '-' && !path) path = argv[i];
+    else { fprintf(stderr, "unknown option %s\n", argv[i]); return 1; }
+  }
+  if (!path) {
+    fprintf(stderr, "usage: %s frames.log [-r] [-p prefix] [-z pixels] [-b]\n", argv[0]);
+    return 1;
+  }
+  if (scale < 2) scale = 2;
+
+  LogReader reader;
+  if (!openLog(reader, path)) return 1;
+  initNumbers();
+  Picture picture;
+  initPicture(picture, scale);
+  std::string screen;
+  if (!prefix && !bench) fputs("\x1b[2J", stdout);
+
+  auto begin = std::chrono::steady_clock::now();
+  unsigned long firstTime = 0;
+  unsigned long frames = 0;
+  while (nextRecord(reader)) {
+    if (bench || prefix) drawPicture(picture, reader);
+    if (reader.continued) continue;
+    if (frames == 0) firstTime = reader.time;
+    if (prefix) {
+      if (!writePicture(picture, prefix, frames)) return 1;
+    }
+    else if (!bench) {
+      if (realtime) {
+        auto due = begin + std::chrono::milliseconds(reader.time - firstTime);
+        auto wait = due - std::chrono::steady_clock::now();
+        if (wait.count() > 0) {
+          fflush(stdout);
+          usleep(std::chrono::duration_cast<std::chrono::microseconds>(wait).count());
+        }
+      }
+      drawTerminal(reader, screen);
+    }
+    frames++;
+  }
+  fflush(stdout);
+
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+  fprintf(stderr, "%lu frames, %lums of show, %zu bytes skipped, %.0f frames/s\n",
+          frames, frames ? reader.time - firstTime : 0, reader.skipped,
+          seconds > 0 ? frames / seconds : 0.0);
+  return 0;
+}
@@ -0,0 +1,107 @@
+/******************************************************************************\
+| CUBESIM.CPP                                                                  |
+|                                                                              |
+| Runs the show through the real cubehelper.h display queue and interrupts on  |
+| a simulated ATmega328 (tools/sim), and reports for each pattern how much of  |
+| the time the CPU was awake, how often each timer interrupted and how late    |
+| frames reached the LEDs. The sketch's own CUBE_PROFILE statistics are        |
+| printed alongside, so they can be checked against the simulator's count.     |
+| The frame log is built in as well and drains at 9600 baud; -l saves it for   |
+| tools/cubeplay.cpp.                                                          |
+|                                                                              |
+|   g++ -O2 -Itools/sim -o cubesim tools/cubesim.cpp                           |
+|   ./cubesim [-s seed] [-l frames.log]                                        |
+\******************************************************************************/
+
+#define CUBE_PROFILE
+#define CUBE_FRAME_LOG
+#include "Arduino.h"
+#include "../cubehelper.h"
+#include "../cubepatterns.h"
+
+/*------------------------------- FRAME COST --------------------------------*/
+/*
+ *   The main loop's drawing is charged when it next goes to sleep. These are
+ *   inputs counted by hand from the steps of the code, not measurements, and
+ *   the busy figures the simulator prints follow from them:
+ *
+ *     per frame      clearBuffer() setting 192 bytes at about 5 cycles each,
+ *                    and flushBuffer() counting and walking the 24 bytes of
+ *                    the lit masks at about 10 cycles each
+ *     per lit color  about 40 cycles to render it, 15 for markLit() and
+ *                    30 for flushBuffer() to find it and queue its entry
+ *
+ *   Like the interrupt costs in tools/sim/Arduino.h they are estimates, so
+ *   compare patterns with each other rather than trusting the last percent.
+ */
+/*---------------------------------------------------------------------------*/
+#define SIM_FRAME_CYCLES 1200
+#define SIM_LIT_CYCLES   85
+
+byte charged_head = 1;
+void chargeFrames() {
+  while (charged_head != _queue_head) {
+    simWork(SIM_FRAME_CYCLES + SIM_LIT_CYCLES * _frame_queue[charged_head & FRAME_QUEUE_MASK].lit);
+    charged_head++;
+  }
+}
+
+/*------------------------------ FRAME LATENESS -----------------------------*/
+/*
+ *   Every time the display moves to a new frame, how long after its
+ *   presentation time that was.
+ */
+/*---------------------------------------------------------------------------*/
+byte watched_tail = 0;
+unsigned long frames_shown = 0;
+unsigned long late_total = 0;
+unsigned long late_worst = 0;
+void watchDisplay() {
+  if (watched_tail == _queue_tail) return;
+  watched_tail = _queue_tail;
+  unsigned long late = _timer_ticks - _frame_queue[watched_tail & FRAME_QUEUE_MASK].pts;
+  frames_shown++;
+  late_total += late;
+  if (late > late_worst) late_worst = late;
+}
+
+int main(int argc, char ** argv) {
+  uint32_t seed = 2019;
+  for (int i = 1; i+1 < argc; i += 2) {
+    if (strcmp(argv[i], "-s") == 0) seed = strtoul(argv[i+1], 0, 0);
+    else if (strcmp(argv[i], "-l") == 0) {
+      sim_serial_log = fopen(argv[i+1], "wb");
+      if (!sim_serial_log) { perror(argv[i+1]); return 1; }
+    }
+  }
+
+  sim_work_hook = chargeFrames;
+  sim_interrupt_hook = watchDisplay;
+  initCube();
+
+  unsigned long start = 0;
+  for (unsigned int i = 0; i < SHOW_PATTERNS; i++) {
+    const CubePattern & pattern = cube_show[i];
+    uint64_t awake = sim_awake, asleep = sim_asleep, inSleep = sim_in_sleep;
+    unsigned long interrupts[3] = {sim_interrupts[0], sim_interrupts[1], sim_interrupts[2]};
+    frames_shown = late_total = late_worst = 0;
+
+    seekShow(start);
+    playShow(pattern.duration, seed);
+    start += pattern.duration;
+
+    uint64_t total = (sim_awake - awake) + (sim_asleep - asleep);
+    double seconds = (double)total / F_CPU;
+    printf("  simulated: CPU awake %.1f%%, main loop busy %.1f%%\n",
+           100.0 * (sim_awake - awake) / total,
+           100.0 - 100.0 * (sim_in_sleep - inSleep) / total);
+    printf("  timer0 %.0f/s, timer1 %.0f/s, timer2 %.0f/s\n",
+           (sim_interrupts[0] - interrupts[0]) / seconds,
+           (sim_interrupts[1] - interrupts[1]) / seconds,
+           (sim_interrupts[2] - interrupts[2]) / seconds);
+    printf("  %lu frames shown, %.2fms late on average, %lums at worst\n",
+           frames_shown, frames_shown ? (double)late_total / frames_shown : 0.0, late_worst);
+  }
+  if (sim_serial_log) fclose(sim_serial_log);
+  return 0;
+}
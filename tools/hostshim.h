@@ -0,0 +1,84 @@
+/******************************************************************************\
+| HOSTSHIM.H                                                                   |
+|                                                                              |
+| Stand-ins for the parts of the Arduino core and cubehelper.h that the cube   |
+| headers use, so the host tools in this folder can compile them with g++ on   |
+| Linux. Time is simulated: delay() only moves the fake millis() clock         |
+| forward, and flushBuffer() hands each frame to the tool through              |
+| host_frame_callback and writes it to host_frame_log as cubelog.h records.    |
+\******************************************************************************/
+
+#ifndef _HOSTSHIM_H_
+#define _HOSTSHIM_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef uint8_t byte;
+
+#define PROGMEM
+#define F(string) string
+#define pgm_read_byte(address) (*(const uint8_t *)(address))
+#define pgm_read_word(address) (*(const uint16_t *)(address))
+
+#define BUFFERSIZE 192
+
+#include "../cubemask.h"
+#include "../cubelog.h"
+
+/* 1KB of EEPROM, erased to 0xFF like a new ATmega328. */
+uint8_t host_eeprom[1024];
+struct _host_eeprom_init { _host_eeprom_init() { memset(host_eeprom, 0xFF, sizeof(host_eeprom)); } } _host_eeprom_init_;
+uint8_t eeprom_read_byte(const uint8_t * address) { return host_eeprom[(uintptr_t)address & 0x3FF]; }
+void eeprom_update_byte(uint8_t * address, uint8_t value) { host_eeprom[(uintptr_t)address & 0x3FF] = value; }
+
+bool continuePattern = false;
+
+/* The pattern timer from cubehelper.h, checked whenever time moves on. */
+unsigned long host_millis = 0;
+unsigned long host_pattern_end = 0;
+unsigned long millis() { return host_millis; }
+unsigned long micros() { return host_millis * 1000; }
+void delay(unsigned long ms) {
+  host_millis += ms;
+  if (host_millis >= host_pattern_end) continuePattern = false;
+}
+void startPatternTimer(unsigned int duration) {
+  continuePattern = true;
+  host_pattern_end = host_millis + duration;
+}
+
+char host_buffer[BUFFERSIZE];
+char * _cube_buffer = host_buffer;
+const byte _color_planes[] = {0x01,0x02,0x04,0x03,0x06,0x05,0x07};
+
+/* The lit LED masks of _cube_buffer, kept the same way as in cubehelper.h. */
+CubeMask _cube_mask[3];
+inline void markLit(const char * buffer, byte index) {
+  if (buffer == _cube_buffer) maskSet(_cube_mask[index >> 6], index);
+}
+inline void clearLit(const char * buffer) {
+  if (buffer == _cube_buffer) _cube_mask[0] = _cube_mask[1] = _cube_mask[2] = 0;
+}
+
+void (*host_frame_callback)(const char * buffer) = 0;
+FILE * host_frame_log = 0;
+CubeLog host_log;
+
+void clearBuffer() {
+  memset(_cube_buffer, 0, BUFFERSIZE);
+  clearLit(_cube_buffer);
+}
+
+void flushBuffer() {
+  if (host_frame_callback) host_frame_callback(_cube_buffer);
+  if (host_frame_log) {
+    uint8_t record[LOG_RECORD_MAX];
+    unsigned int length = encodeFrame(host_log, host_millis, _cube_buffer, _cube_mask, record, sizeof(record));
+    fwrite(record, 1, length, host_frame_log);
+  }
+}
+
+#endif
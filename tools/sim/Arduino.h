@@ -0,0 +1,221 @@
+/******************************************************************************\
+| ARDUINO.H (simulator)                                                        |
+|                                                                              |
+| A cycle counting stand-in for the Arduino core and the ATmega328 timers,     |
+| used by tools/cubesim.cpp to run cubehelper.h and cubepatterns.h on Linux,   |
+| and by tools/cubecheck.cpp to check the timer wheel and display queue.       |
+| Interrupts never arrive on their own: the simulated clock only moves in      |
+| simWork() and sleep_cpu(), which fire the Timer0, Timer1 and Timer2          |
+| interrupts that fall due on the way and charge SIM_*_CYCLES for each one.    |
+| Those costs are estimates from the generated code, not measurements.         |
+\******************************************************************************/
+
+#ifndef _SIM_ARDUINO_H_
+#define _SIM_ARDUINO_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ARDUINO 10800
+#define F_CPU 16000000L
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+#include "avr/pgmspace.h"
+
+/*-------------------------------- REGISTERS --------------------------------*/
+volatile uint8_t PORTB, PORTC, PORTD, DDRB, DDRC, DDRD;
+volatile uint8_t TCCR0A, TCCR0B, TCNT0, OCR0A, OCR0B, TIMSK0, TIFR0;
+volatile uint8_t TCCR1A, TCCR1B, TCCR1C, TIMSK1, TIFR1;
+volatile uint8_t TCCR2A, TCCR2B, TCNT2, OCR2A, OCR2B, TIMSK2, TIFR2, SREG;
+volatile uint16_t OCR1A, OCR1B, ICR1;
+
+enum { CS00=0,CS01,CS02, WGM00=0,WGM01=1,WGM02=3, TOIE0=0,OCIE0A=1,OCIE0B=2,
+       CS10=0,CS11,CS12, WGM10=0,WGM11=1,WGM12=3,WGM13=4, TOIE1=0,OCIE1A=1,OCIE1B=2, OCF1A=1,
+       CS20=0,CS21,CS22, WGM20=0,WGM21=1,WGM22=3, TOIE2=0,OCIE2A=1,OCIE2B=2, TOV2=0 };
+#define B11111000 0xF8
+
+#define ISR(vector) extern "C" void vector()
+extern "C" void TIMER1_COMPA_vect();
+extern "C" void TIMER2_OVF_vect();
+void cli() {}
+void sei() {}
+
+/*---------------------------------- CLOCK ----------------------------------*/
+#define SIM_TIMER0_CYCLES 80   // the core's millis() interrupt
+#define SIM_TIMER1_CYCLES 70   // cubetimer.h tick and _displayTick()
+#define SIM_TIMER2_CYCLES 75   // one display step
+#define SIM_WAKE_CYCLES   40   // leaving sleep and going round the delay() loop
+
+uint64_t sim_cycles = 0;
+uint64_t sim_awake = 0;
+uint64_t sim_asleep = 0;
+uint64_t sim_in_sleep = 0;   // whole sleep_cpu() calls, with the interrupt that woke it
+uint64_t sim_event = 0;
+uint64_t sim_timer0_next = 16384;
+uint64_t sim_timer1_last = 0;
+uint64_t sim_timer2_next = 0;
+unsigned int sim_timer2_period = 0;
+unsigned long sim_interrupts[3] = {0, 0, 0};
+
+/* cubesim.cpp charges the main loop's drawing here, and checks each interrupt */
+void (*sim_work_hook)() = 0;
+void (*sim_interrupt_hook)() = 0;
+
+unsigned int _simTimer2Period() {
+  byte clock = TCCR2B & 0x07;
+  if (clock == 1) return 256;
+  if (clock == 2) return 256*8;
+  return 0;
+}
+
+/*
+ *   Fires the next interrupt if it is due by until, leaving its time in
+ *   sim_event, and returns false if there is none. Timer2 keeps counting
+ *   while its interrupt is off, and an overflow that happened meanwhile
+ *   fires as soon as the interrupt is turned back on, like the TOV2 flag.
+ */
+bool _simInterrupt(uint64_t until) {
+  uint64_t timer0 = sim_timer0_next;
+  uint64_t timer1 = (TIMSK1 & (1<<OCIE1A)) ? sim_timer1_last + 16000 : UINT64_MAX;
+
+  unsigned int period = _simTimer2Period();
+  if (period != sim_timer2_period) {
+    sim_timer2_period = period;
+    sim_timer2_next = sim_cycles + period;
+  }
+  uint64_t timer2 = UINT64_MAX;
+  if (period && (TIMSK2 & (1<<TOIE2))) timer2 = sim_timer2_next;
+
+  /* an interrupt that came due while another one ran waits for it to finish */
+  uint64_t next = timer0 < timer1 ? timer0 : timer1;
+  if (timer2 < next) next = timer2;
+  uint64_t at = next < sim_cycles ? sim_cycles : next;
+  if (at > until) return false;
+  sim_cycles = sim_event = at;
+
+  if (next == timer2) {
+    sim_timer2_next += ((at - sim_timer2_next) / period + 1) * period;
+    TIMER2_OVF_vect();
+    sim_interrupts[2]++;
+    sim_cycles += SIM_TIMER2_CYCLES;
+    sim_awake += SIM_TIMER2_CYCLES;
+  }
+  else if (next == timer1) {
+    sim_timer1_last = next;
+    TIMER1_COMPA_vect();
+    sim_interrupts[1]++;
+    sim_cycles += SIM_TIMER1_CYCLES;
+    sim_awake += SIM_TIMER1_CYCLES;
+  }
+  else {
+    sim_timer0_next += 16384;
+    sim_interrupts[0]++;
+    sim_cycles += SIM_TIMER0_CYCLES;
+    sim_awake += SIM_TIMER0_CYCLES;
+  }
+  if (sim_interrupt_hook) sim_interrupt_hook();
+  return true;
+}
+
+/* Runs the main loop for cycles, with interrupts taking their share on the way. */
+void simWork(uint64_t cycles) {
+  sim_awake += cycles;
+  while (true) {
+    uint64_t start = sim_cycles;
+    if (!_simInterrupt(sim_cycles + cycles)) break;
+    cycles -= sim_event - start;
+  }
+  sim_cycles += cycles;
+}
+
+/*---------------------------------- SLEEP ----------------------------------*/
+#define SLEEP_MODE_IDLE 0
+
+/* idleSleep() starts with this, so the drawing done since is charged before it sleeps */
+void set_sleep_mode(int) {
+  if (sim_work_hook) sim_work_hook();
+}
+void sleep_enable() {}
+void sleep_disable() {}
+
+/* Sleeps until the next interrupt. */
+void sleep_cpu() {
+  uint64_t start = sim_cycles;
+  _simInterrupt(UINT64_MAX);
+  sim_asleep += sim_event - start;
+  simWork(SIM_WAKE_CYCLES);
+  sim_in_sleep += sim_cycles - start;
+}
+
+struct _SimTcnt1 {
+  operator uint16_t() const { return (sim_cycles - sim_timer1_last) / 64; }
+  _SimTcnt1 & operator=(uint16_t) { return *this; }
+} TCNT1;
+
+unsigned long millis() { return sim_cycles / 16000; }
+unsigned long micros() { return sim_cycles / 16; }
+
+void yield();
+void delay(unsigned long ms) {
+  unsigned long start = micros();
+  while (ms > 0) {
+    yield();
+    while (ms > 0 && (micros() - start) >= 1000) {
+      ms--;
+      start += 1000;
+    }
+  }
+}
+
+/*--------------------------------- SERIAL ----------------------------------*/
+class __FlashStringHelper;
+#define F(string) ((const __FlashStringHelper *)(string))
+
+/*---------------------------------- SERIAL ---------------------------------*/
+/*
+ *   Text goes to stdout. Binary writes are the frame log: they go to
+ *   sim_serial_log, and availableForWrite() drains the 64 byte transmit
+ *   buffer at SIM_SERIAL_BAUD, ten bits a byte, on the simulated clock.
+ */
+/*---------------------------------------------------------------------------*/
+#define SIM_SERIAL_BAUD 9600
+#define SIM_SERIAL_BUFFER 64
+#define SIM_SERIAL_BYTE_CYCLES (F_CPU / (SIM_SERIAL_BAUD / 10))
+
+FILE * sim_serial_log = 0;
+uint64_t sim_serial_empty = 0;   // when the transmit buffer will have drained
+
+struct SimSerial {
+  void begin(unsigned long) {}
+  int availableForWrite() {
+    if (sim_serial_empty <= sim_cycles) return SIM_SERIAL_BUFFER - 1;
+    int queued = (sim_serial_empty - sim_cycles + SIM_SERIAL_BYTE_CYCLES - 1) / SIM_SERIAL_BYTE_CYCLES;
+    return queued >= SIM_SERIAL_BUFFER - 1 ? 0 : SIM_SERIAL_BUFFER - 1 - queued;
+  }
+  size_t write(const byte * data, size_t length) {
+    if (sim_serial_empty < sim_cycles) sim_serial_empty = sim_cycles;
+    sim_serial_empty += length * SIM_SERIAL_BYTE_CYCLES;
+    if (sim_serial_log) fwrite(data, 1, length, sim_serial_log);
+    return length;
+  }
+  int available() { return 0; }
+  int peek() { return -1; }
+  int read() { return -1; }
+  size_t readBytes(byte *, size_t) { return 0; }
+  size_t write(byte value) { return fputc(value, stdout) != EOF; }
+  size_t print(const char * text) { return printf("%s", text); }
+  size_t print(const __FlashStringHelper * text) { return printf("%s", (const char *)text); }
+  size_t print(unsigned long value) { return printf("%lu", value); }
+  size_t print(long value) { return printf("%ld", value); }
+  size_t print(unsigned int value) { return printf("%u", value); }
+  size_t print(int value) { return printf("%d", value); }
+  size_t print(byte value) { return printf("%u", value); }
+  template <class T> size_t println(T value) { size_t n = print(value); return n + printf("\n"); }
+  size_t println() { return printf("\n"); }
+} Serial;
+
+#endif
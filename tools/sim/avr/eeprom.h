@@ -0,0 +1,13 @@
+/* Simulator stand-in for avr/eeprom.h: 1KB erased to 0xFF like a new ATmega328. */
+#ifndef _SIM_EEPROM_H_
+#define _SIM_EEPROM_H_
+
+#include <stdint.h>
+#include <string.h>
+
+uint8_t sim_eeprom[1024];
+struct _SimEepromInit { _SimEepromInit() { memset(sim_eeprom, 0xFF, sizeof(sim_eeprom)); } } _sim_eeprom_init;
+uint8_t eeprom_read_byte(const uint8_t * address) { return sim_eeprom[(uintptr_t)address & 0x3FF]; }
+void eeprom_update_byte(uint8_t * address, uint8_t value) { sim_eeprom[(uintptr_t)address & 0x3FF] = value; }
+
+#endif
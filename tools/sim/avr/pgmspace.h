@@ -0,0 +1,11 @@
+/* Simulator stand-in for avr/pgmspace.h: flash is ordinary memory on the host. */
+#ifndef _SIM_PGMSPACE_H_
+#define _SIM_PGMSPACE_H_
+
+#include <stdint.h>
+
+#define PROGMEM
+#define pgm_read_byte(address) (*(const uint8_t *)(address))
+#define pgm_read_word(address) (*(const uint16_t *)(address))
+
+#endif
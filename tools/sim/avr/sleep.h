@@ -0,0 +1,2 @@
+/* Simulator stand-in for avr/sleep.h: sleep_cpu() is in the simulated Arduino.h. */
+#include "../Arduino.h"